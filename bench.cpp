@@ -0,0 +1,981 @@
+/*    Copyright (C) David M. Rogers, 2014
+ *
+ *    David M. Rogers <predictivestatmech@gmail.com>
+ *    Nonequilibrium Stat. Mech. Research Group
+ *    Department of Chemistry
+ *    University of South Florida
+ *
+ *    This file is part of rbtree.
+ *
+ *    rbtree is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    rbtree is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with rbtree.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Timing comparisons for rbtree.
+ *
+ * usage: bench [name|all [N [seed]]]
+ *
+ *   cxx - rbop_t (run-time layout, cmp through a pointer)
+ *         vs. rb::intrusive_tree (compile-time layout, inlined cmp)
+ *   build - sorted add_node vs. build_tree_sorted
+ *   union - merging trees by add_node vs. rb_union (1 and 8 threads)
+ *   batch - sorted batches of 1k and 100k by add_node vs. add_nodes_sorted
+ *   map   - mixed lookup/add/del throughput on 1-8 threads: one tree
+ *           behind a mutex vs. rbmap_t with 64 shards
+ *   lookup - lookup_node (cmp, then typed key) vs. batched lookup_nodes
+ *   pool  - lookups in an aged rbpool_t, then after BFS and vEB compaction
+ *   freeze - lookup_node vs. frozen_lookup
+ *   dedup - insert-if-absent over keys seen twice each:
+ *           lookup_node then add_node vs. find_or_add_node
+ *   pq    - hold model (pop the minimum, re-add it later) on rbpq_t
+ *           vs. std::priority_queue
+ *   file  - cold start: re-adding every node vs. mapping a saved tree,
+ *           then lookups in the mapping
+ *   suite - CSV of throughput and p50/p99/p999 latency for insert,
+ *           lookup, delete and mixed ops, for sizes 1k, 10k, ... up to N,
+ *           sequential/random/Zipfian/sliding-window keys, against
+ *           rb::intrusive_tree, std::set and std::map
+ */
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "rbtree.h"
+#include "rbmap.h"
+#include "rbpool.h"
+#include "rbfreeze.h"
+#include "rbfile.h"
+#include "rbpq.h"
+#include "rbtree.hpp"
+#include <vector>
+#include <algorithm>
+#include <set>
+#include <map>
+#include <queue>
+#include <functional>
+#include <math.h>
+#include <stdint.h>
+
+struct ent {
+    int n;
+    unsigned char mark;
+    ent *L, *R;
+};
+
+static ent nil = {-1, 0, NULL, NULL};
+
+static int int_cmp(const void *ai, const void *bi) {
+    const ent *a = (const ent *)ai;
+    const ent *b = (const ent *)bi;
+    return a->n - b->n;
+}
+
+static const rbop_t rbinf = {
+    int_cmp,
+    (unsigned int)offsetof(ent, L),
+    (unsigned int)offsetof(ent, mark),
+    1,
+    &nil,
+};
+
+struct ent_cmp {
+    int operator()(const ent &a, const ent &b) const {
+        return a.n - b.n;
+    }
+    int operator()(int a, const ent &b) const {
+        return a - b.n;
+    }
+};
+
+typedef rb::intrusive_tree<ent, &ent::L, &ent::R, &ent::mark, ent_cmp> ent_tree;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+static void shuffle(int *ord, size_t n) {
+    for(size_t j=0; j<n; j++) {
+        size_t k = random() % (n-j) + j;
+        int i = ord[k];
+        ord[k] = ord[j];
+        ord[j] = i;
+    }
+}
+
+static void report(const char *bench, const char *op,
+                   size_t n, double dt) {
+    printf("%-6s %-16s %10zu %10.1f ns/op\n", bench, op, n, 1e9*dt/n);
+}
+
+static int bench_cxx(size_t n) {
+    ent *a = (ent *)malloc(n*sizeof(ent));
+    ent *b = (ent *)malloc(n*sizeof(ent));
+    int *ord = (int *)malloc(n*sizeof(int));
+    void *tree = rbinf.nil;
+    ent_tree t(&nil);
+    size_t i, hit;
+    double t0;
+
+    if(a == NULL || b == NULL || ord == NULL) {
+        perror("malloc");
+        return 2;
+    }
+    for(i=0; i<n; i++) {
+        a[i].n = b[i].n = ord[i] = i;
+    }
+
+    shuffle(ord, n);
+    t0 = now();
+    for(i=0; i<n; i++)
+        add_node(&tree, a+ord[i], &rbinf);
+    report("cxx", "rbop_t add", n, now()-t0);
+    t0 = now();
+    for(i=0; i<n; i++)
+        t.insert(b+ord[i]);
+    report("cxx", "template add", n, now()-t0);
+
+    shuffle(ord, n);
+    t0 = now();
+    for(i=hit=0; i<n; i++)
+        hit += lookup_node(tree, &ord[i], &rbinf) != &nil;
+    report("cxx", "rbop_t lookup", n, now()-t0);
+    t0 = now();
+    for(i=0; i<n; i++)
+        hit -= t.find(ord[i]) != &nil;
+    report("cxx", "template lookup", n, now()-t0);
+    if(hit != 0) {
+        printf("lookup mismatch!\n");
+        return 1;
+    }
+
+    shuffle(ord, n);
+    t0 = now();
+    for(i=0; i<n; i++)
+        del_node(&tree, &ord[i], &rbinf);
+    report("cxx", "rbop_t del", n, now()-t0);
+    t0 = now();
+    for(i=0; i<n; i++)
+        t.erase(ord[i]);
+    report("cxx", "template del", n, now()-t0);
+    if(tree != &nil || !t.empty()) {
+        printf("trees not empty after deletion!\n");
+        return 1;
+    }
+
+    free(ord);
+    free(b);
+    free(a);
+    return 0;
+}
+
+static int bench_build(size_t n) {
+    ent *a = (ent *)malloc(n*sizeof(ent));
+    void **nodes = (void **)malloc(n*sizeof(void *));
+    void *tree = rbinf.nil;
+    size_t i;
+    double t0;
+
+    if(a == NULL || nodes == NULL) {
+        perror("malloc");
+        return 2;
+    }
+    for(i=0; i<n; i++) {
+        a[i].n = i;
+        nodes[i] = a+i;
+    }
+    t0 = now();
+    for(i=0; i<n; i++)
+        add_node(&tree, a+i, &rbinf);
+    report("build", "sorted add_node", n, now()-t0);
+    tree = rbinf.nil;
+    t0 = now();
+    for(i=0; i<n; i++)
+        add_node_last(&tree, a+i, &rbinf);
+    report("build", "add_node_last", n, now()-t0);
+    t0 = now();
+    tree = build_tree_sorted(nodes, n, &rbinf);
+    report("build", "build_tree_sorted", n, now()-t0);
+
+    free(nodes);
+    free(a);
+    return 0;
+}
+
+static size_t count_nodes(void *tree) {
+    rbpath_t it;
+    size_t n = 0;
+
+    for(void *x = first_node(&it, tree, &rbinf); x != &nil;
+                x = next_node(&it, &rbinf))
+        n++;
+    return n;
+}
+
+// Merge B (every k-th key, offset by 1) into A (even keys).
+static int bench_union1(ent *a, void **nodes, size_t n, size_t k) {
+    void *A, *B;
+    size_t i, na, nb;
+    double t0;
+    char name[32];
+    rbsetop_t s = {NULL, NULL, 1};
+
+    for(int mode = 0; mode < 3; mode++) {
+        for(i=na=0; i<n; i+=2)
+            nodes[na++] = a+i;
+        A = build_tree_sorted(nodes, na, &rbinf);
+        for(i=1, nb=0; i<n; i+=k)
+            nodes[nb++] = a+i;
+        B = build_tree_sorted(nodes, nb, &rbinf);
+
+        t0 = now();
+        if(mode == 0) {
+            for(i=0; i<nb; i++)
+                add_node(&A, nodes[i], &rbinf);
+        } else {
+            s.threads = mode == 1 ? 1 : 8;
+            A = rb_union(A, B, &s, &rbinf);
+        }
+        if(mode == 0) snprintf(name, sizeof(name), "add_node 1/%zu", k);
+        else snprintf(name, sizeof(name), "rb_union(%d) 1/%zu", s.threads, k);
+        report("union", name, nb, now()-t0);
+        if(count_nodes(A) != na+nb) {
+            printf("union lost nodes!\n");
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int bench_union(size_t n) {
+    ent *a = (ent *)malloc(n*sizeof(ent));
+    void **nodes = (void **)malloc(n*sizeof(void *));
+    size_t i;
+    int ret;
+
+    if(a == NULL || nodes == NULL) {
+        perror("malloc");
+        return 2;
+    }
+    for(i=0; i<n; i++)
+        a[i].n = i;
+    if( (ret = bench_union1(a, nodes, n, 2)) == 0)
+        ret = bench_union1(a, nodes, n, 128);
+    free(nodes);
+    free(a);
+    return ret;
+}
+
+static int bench_batch(size_t n) {
+    ent *a = (ent *)malloc(2*n*sizeof(ent));
+    void **nodes = (void **)malloc(n*sizeof(void *));
+    size_t i, m, k, ops = 0;
+    void *A;
+    double t0, dt[2];
+    char name[32];
+
+    if(a == NULL || nodes == NULL) {
+        perror("malloc");
+        return 2;
+    }
+    for(i=0; i<2*n; i++)
+        a[i].n = i;
+    for(m = 1000; m <= 100000 && m <= n; m *= 100) {
+        for(int mode = 0; mode < 2; mode++) {
+            for(i=0; i<n; i++)
+                nodes[i] = a+2*i;
+            A = build_tree_sorted(nodes, n, &rbinf);
+            dt[mode] = 0.0;
+            ops = 0;
+            // batches of m consecutive odd keys, spread over the tree
+            for(k = 0; k+m <= n; k += n/8) {
+                for(i=0; i<m; i++)
+                    nodes[i] = a+2*(k+i)+1;
+                t0 = now();
+                if(mode == 0) {
+                    for(i=0; i<m; i++)
+                        add_node(&A, nodes[i], &rbinf);
+                } else {
+                    add_nodes_sorted(&A, nodes, m, &rbinf);
+                }
+                dt[mode] += now()-t0;
+                ops += m;
+            }
+            snprintf(name, sizeof(name), "%s %zu",
+                     mode == 0 ? "add_node" : "add_nodes_sorted", m);
+            report("batch", name, ops, dt[mode]);
+        }
+    }
+    free(nodes);
+    free(a);
+    return 0;
+}
+
+struct map_arg {
+    rbmap_t *m; // or NULL to use tree and mtx
+    void **tree;
+    pthread_mutex_t *mtx;
+    ent *a;
+    size_t n, ops;
+    unsigned long seed;
+};
+
+static unsigned long xorshift(unsigned long *x) {
+    *x ^= *x << 13;
+    *x ^= *x >> 7;
+    *x ^= *x << 17;
+    return *x;
+}
+
+// 90% lookup, 5% add, 5% del of random keys in [0, 2n)
+static void *map_thread(void *arg) {
+    map_arg *w = (map_arg *)arg;
+    size_t i;
+
+    for(i=0; i<w->ops; i++) {
+        unsigned long r = xorshift(&w->seed);
+        int k = r % (2*w->n), op = (r >> 32) % 20;
+
+        if(w->m != NULL) {
+            if(op == 0) rbmap_add(w->m, w->a+k);
+            else if(op == 1) rbmap_del(w->m, &k);
+            else rbmap_lookup(w->m, &k);
+        } else {
+            pthread_mutex_lock(w->mtx);
+            if(op == 0) add_node(w->tree, w->a+k, &rbinf);
+            else if(op == 1) del_node(w->tree, &k, &rbinf);
+            else lookup_node(*w->tree, &k, &rbinf);
+            pthread_mutex_unlock(w->mtx);
+        }
+    }
+    return NULL;
+}
+
+static int bench_map(size_t n) {
+    ent *a = (ent *)malloc(2*n*sizeof(ent));
+    pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+    pthread_t th[8];
+    map_arg w[8];
+    rbmap_t m;
+    void *tree;
+    size_t i;
+    double t0;
+    char name[32];
+
+    if(a == NULL) {
+        perror("malloc");
+        return 2;
+    }
+    for(i=0; i<2*n; i++)
+        a[i].n = i;
+    for(int sharded = 0; sharded < 2; sharded++) {
+        for(int nt = 1; nt <= 8; nt *= 2) {
+            tree = rbinf.nil;
+            if(sharded && rbmap_init(&m, 64, sizeof(ent), &rbinf)) {
+                perror("rbmap_init");
+                free(a);
+                return 2;
+            }
+            for(i=0; i<n; i++) { // half the keys present
+                if(sharded) rbmap_add(&m, a+2*i);
+                else add_node(&tree, a+2*i, &rbinf);
+            }
+            t0 = now();
+            for(int t=0; t<nt; t++) {
+                w[t].m = sharded ? &m : NULL;
+                w[t].tree = &tree;
+                w[t].mtx = &mtx;
+                w[t].a = a;
+                w[t].n = n;
+                w[t].ops = n;
+                w[t].seed = 88172645463325252UL + t;
+                pthread_create(th+t, NULL, map_thread, w+t);
+            }
+            for(int t=0; t<nt; t++)
+                pthread_join(th[t], NULL);
+            snprintf(name, sizeof(name), "%s %d thr",
+                     sharded ? "rbmap" : "mutex", nt);
+            report("map", name, n*nt, now()-t0);
+            if(sharded) rbmap_free(&m, NULL, NULL);
+        }
+    }
+    free(a);
+    return 0;
+}
+
+static double time_lookups(void *tree, int *ord, size_t n) {
+    size_t i, hit = 0;
+    double t0;
+
+    shuffle(ord, n);
+    t0 = now();
+    for(i=0; i<n; i++)
+        hit += lookup_node(tree, &ord[i], &rbinf) != &nil;
+    t0 = now()-t0;
+    return hit == n ? t0 : -1.0;
+}
+
+// Lookups in an aged pool, then after compacting it each way.
+static int bench_pool(size_t n) {
+    int *ord = (int *)malloc(n*sizeof(int));
+    rbpool_t pl;
+    void *tree = rbinf.nil;
+    ent *a;
+    size_t i, r, m = n/8;
+    double t0, dt;
+
+    if(ord == NULL) {
+        perror("malloc");
+        return 2;
+    }
+    pool_init(&pl, sizeof(ent), 4096);
+    for(i=0; i<n; i++)
+        ord[i] = i;
+    shuffle(ord, n);
+    for(i=0; i<n; i++) {
+        if( (a = (ent *)pool_alloc(&pl)) == NULL) {
+            perror("pool_alloc");
+            return 2;
+        }
+        a->n = ord[i];
+        add_node(&tree, a, &rbinf);
+    }
+    for(r=0; r<8; r++) { // churn: take out m keys, put them back
+        shuffle(ord, n);
+        for(i=0; i<m; i++)
+            pool_free(&pl, del_node(&tree, &ord[i], &rbinf));
+        shuffle(ord, m);
+        for(i=0; i<m; i++) {
+            a = (ent *)pool_alloc(&pl);
+            a->n = ord[i];
+            add_node(&tree, a, &rbinf);
+        }
+    }
+
+    for(int order = -1; order <= RB_VEB; order++) {
+        if(order >= 0) {
+            t0 = now();
+            if(pool_compact(&pl, &tree, order, NULL, NULL, &rbinf)) {
+                perror("pool_compact");
+                return 2;
+            }
+            report("pool", order == RB_BFS ? "compact bfs" : "compact veb",
+                   n, now()-t0);
+        }
+        if( (dt = time_lookups(tree, ord, n)) < 0) {
+            printf("lookup mismatch!\n");
+            return 1;
+        }
+        report("pool", order < 0 ? "aged lookup" : order == RB_BFS
+                       ? "bfs lookup" : "veb lookup", n, dt);
+    }
+    pool_destroy(&pl);
+    free(ord);
+    return 0;
+}
+
+// One key at a time (through cmp, then typed), then in batches of m.
+static int bench_lookup(size_t n) {
+    rbop_t rbkey = rbinf;
+    ent *a = (ent *)malloc(n*sizeof(ent));
+    int *ord = (int *)malloc(n*sizeof(int));
+    const void **keys = (const void **)malloc(n*sizeof(void *));
+    void **out = (void **)malloc(n*sizeof(void *));
+    void *tree = rbinf.nil;
+    size_t i, m, hit = 0, found;
+    double t0;
+    char name[32];
+
+    if(a == NULL || ord == NULL || keys == NULL || out == NULL) {
+        perror("malloc");
+        return 2;
+    }
+    for(i=0; i<n; i++)
+        a[i].n = ord[i] = i;
+    shuffle(ord, n);
+    for(i=0; i<n; i++)
+        add_node(&tree, a+ord[i], &rbinf);
+    shuffle(ord, n);
+    for(i=0; i<n; i++)
+        keys[i] = ord+i;
+    rbkey.koff = offsetof(ent, n);
+    rbkey.ktype = RB_KEY_INT32;
+
+    t0 = now();
+    for(i=0; i<n; i++)
+        hit += lookup_node(tree, keys[i], &rbinf) != &nil;
+    report("lookup", "lookup_node", n, now()-t0);
+    t0 = now();
+    for(i=found=0; i<n; i++)
+        found += lookup_node(tree, keys[i], &rbkey) != &nil;
+    report("lookup", "lookup_node typed", n, now()-t0);
+    if(found != hit) {
+        printf("lookup mismatch!\n");
+        return 1;
+    }
+    for(m = 16; m <= 1024; m *= 8) {
+        t0 = now();
+        for(i=0; i<n; i+=m)
+            lookup_nodes(tree, keys+i, out+i, n-i < m ? n-i : m, &rbinf);
+        snprintf(name, sizeof(name), "lookup_nodes %zu", m);
+        report("lookup", name, n, now()-t0);
+        for(i=found=0; i<n; i++)
+            found += out[i] != &nil;
+        if(found != hit) {
+            printf("lookup mismatch!\n");
+            return 1;
+        }
+    }
+    free(out);
+    free(keys);
+    free(ord);
+    free(a);
+    return 0;
+}
+
+static long long ent_key(const void *node) {
+    return ((const ent *)node)->n;
+}
+
+static int bench_freeze(size_t n) {
+    ent *a = (ent *)malloc(n*sizeof(ent));
+    int *ord = (int *)malloc(n*sizeof(int));
+    void *tree = rbinf.nil;
+    rbfrozen_t f;
+    size_t i, hit;
+    double t0;
+
+    if(a == NULL || ord == NULL) {
+        perror("malloc");
+        return 2;
+    }
+    for(i=0; i<n; i++)
+        a[i].n = ord[i] = i;
+    shuffle(ord, n);
+    for(i=0; i<n; i++)
+        add_node(&tree, a+ord[i], &rbinf);
+    t0 = now();
+    if(freeze_tree(&f, tree, ent_key, &rbinf)) {
+        perror("freeze_tree");
+        return 2;
+    }
+    report("freeze", "freeze_tree", n, now()-t0);
+
+    shuffle(ord, n);
+    t0 = now();
+    for(i=hit=0; i<n; i++)
+        hit += lookup_node(tree, &ord[i], &rbinf) != &nil;
+    report("freeze", "lookup_node", n, now()-t0);
+    t0 = now();
+    for(i=0; i<n; i++)
+        hit -= frozen_lookup(&f, ord[i]) != &nil;
+    report("freeze", "frozen_lookup", n, now()-t0);
+    if(hit != 0) {
+        printf("lookup mismatch!\n");
+        return 1;
+    }
+    free_frozen(&f);
+    free(ord);
+    free(a);
+    return 0;
+}
+
+static int bench_dedup(size_t n) {
+    ent *a = (ent *)malloc(2*n*sizeof(ent));
+    int *ord = (int *)malloc(2*n*sizeof(int));
+    void *tree;
+    size_t i, added;
+    double t0;
+
+    if(a == NULL || ord == NULL) {
+        perror("malloc");
+        return 2;
+    }
+    for(i=0; i<2*n; i++) {
+        a[i].n = i/2;
+        ord[i] = i;
+    }
+    shuffle(ord, 2*n);
+    for(int single = 0; single < 2; single++) {
+        tree = rbinf.nil;
+        added = 0;
+        t0 = now();
+        for(i=0; i<2*n; i++) {
+            ent *A = a+ord[i];
+            if(single)
+                added += find_or_add_node(&tree, A, &rbinf) == A;
+            else if(lookup_node(tree, A, &rbinf) == &nil) {
+                add_node(&tree, A, &rbinf);
+                added++;
+            }
+        }
+        report("dedup", single ? "find_or_add_node" : "lookup+add_node",
+               2*n, now()-t0);
+        if(added != n) {
+            printf("added %zu of %zu keys!\n", added, n);
+            return 1;
+        }
+    }
+    free(ord);
+    free(a);
+    return 0;
+}
+
+static int bench_pq(size_t n) {
+    ent *a = (ent *)malloc(n*sizeof(ent));
+    int *ord = (int *)malloc(n*sizeof(int));
+    std::priority_queue<int, std::vector<int>, std::greater<int> > h;
+    unsigned long seed = 88172645463325252UL;
+    long sum = 0;
+    rbpq_t q;
+    size_t i;
+    double t0;
+
+    if(a == NULL || ord == NULL) {
+        perror("malloc");
+        return 2;
+    }
+    for(i=0; i<n; i++)
+        ord[i] = i;
+    shuffle(ord, n);
+    pq_init(&q, &rbinf);
+    for(i=0; i<n; i++) {
+        a[i].n = ord[i] * 4; // room to re-add later without collisions
+        pq_add(&q, a+i, &rbinf);
+        h.push(a[i].n);
+    }
+    t0 = now();
+    for(i=0; i<n; i++) {
+        ent *A = (ent *)pop_min(&q, &rbinf);
+        sum += A->n;
+        A->n += 4*n + xorshift(&seed) % 4;
+        pq_add(&q, A, &rbinf);
+    }
+    report("pq", "pop_min+pq_add", n, now()-t0);
+    seed = 88172645463325252UL;
+    t0 = now();
+    for(i=0; i<n; i++) {
+        int k = h.top();
+        h.pop();
+        sum -= k;
+        h.push(k + 4*n + xorshift(&seed) % 4);
+    }
+    report("pq", "priority_queue", n, now()-t0);
+    if(sum != 0) {
+        printf("pop mismatch!\n");
+        return 1;
+    }
+    free(ord);
+    free(a);
+    return 0;
+}
+
+static int bench_file(size_t n) {
+    const char *path = "bench.rbt";
+    ent *a = (ent *)malloc(n*sizeof(ent));
+    int *ord = (int *)malloc(n*sizeof(int));
+    void *tree = rbinf.nil;
+    rbfile_t f;
+    size_t i;
+    double t0, dt;
+
+    if(a == NULL || ord == NULL) {
+        perror("malloc");
+        return 2;
+    }
+    for(i=0; i<n; i++)
+        a[i].n = ord[i] = i;
+    shuffle(ord, n);
+    t0 = now();
+    for(i=0; i<n; i++)
+        add_node(&tree, a+ord[i], &rbinf);
+    report("file", "add_node", n, now()-t0);
+    t0 = now();
+    if(save_tree(path, tree, sizeof(ent), &rbinf)) {
+        perror(path);
+        return 2;
+    }
+    report("file", "save_tree", n, now()-t0);
+    t0 = now();
+    if(map_tree(&f, path, sizeof(ent), &rbinf)) {
+        perror(path);
+        return 2;
+    }
+    printf("%-6s %-16s %10zu %10.1f us\n", "file", "map_tree", n,
+           (now()-t0)*1e6);
+
+    if( (dt = time_lookups(tree, ord, n)) < 0) {
+        printf("lookup mismatch!\n");
+        unmap_tree(&f);
+        unlink(path);
+        return 1;
+    }
+    report("file", "lookup_node", n, dt);
+    shuffle(ord, n);
+    t0 = now();
+    for(i=0; i<n; i++)
+        if(lookup_node(f.root, &ord[i], &f.op) == &nil) break;
+    dt = now()-t0;
+    unmap_tree(&f);
+    unlink(path);
+    if(i != n) {
+        printf("lookup mismatch!\n");
+        return 1;
+    }
+    report("file", "mapped lookup", n, dt);
+    free(ord);
+    free(a);
+    return 0;
+}
+
+/***************************** Suite ********************************/
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000000000ull + ts.tv_nsec;
+}
+
+// The YCSB Zipfian generator (Gray et al.), ranks 0 .. n-1.
+struct zipf_gen {
+    size_t n;
+    double theta, zetan, alpha, eta;
+
+    zipf_gen(size_t n_, double theta_ = 0.99) : n(n_), theta(theta_) {
+        double zeta2 = 1.0 + pow(0.5, theta);
+        zetan = 0.0;
+        for(size_t i=1; i<=n; i++)
+            zetan += 1.0/pow((double)i, theta);
+        alpha = 1.0/(1.0 - theta);
+        eta = (1.0 - pow(2.0/n, 1.0 - theta)) / (1.0 - zeta2/zetan);
+    }
+    size_t next(unsigned long *seed) {
+        double u = (xorshift(seed) >> 11) * 0x1p-53, uz = u*zetan;
+        if(uz < 1.0) return 0;
+        if(uz < 1.0 + pow(0.5, theta)) return 1;
+        size_t r = (size_t)(n * pow(eta*u - eta + 1.0, alpha));
+        return r < n ? r : n-1;
+    }
+};
+
+enum { DIST_SEQ, DIST_RANDOM, DIST_ZIPF, DIST_WINDOW, NDIST };
+static const char *const dist_name[NDIST] = {
+    "seq", "random", "zipf", "window"
+};
+
+/* Key streams over n keys, all < 2n.  Inserts and deletes go in
+ * order (ascending, or shuffled for random and zipf).  Lookups are
+ * ascending, uniform, Zipfian (hot ranks scattered over the keys),
+ * or uniform over the newest eighth (window).  The mixed phase is
+ * 80% lookup, 10% insert, 10% delete over [0, 2n), except window,
+ * which slides: insert the next key, delete the oldest, and look up
+ * twice near the new end.
+ */
+struct workload {
+    int dist;
+    size_t n;
+    std::vector<int> ins, del;
+    zipf_gen *z;
+    unsigned long seed;
+    size_t lo, hi; // window
+
+    workload(int dist_, size_t n_) : dist(dist_), n(n_), ins(n_), del(n_),
+                                     z(NULL), seed(88172645463325252UL) {
+        for(size_t i=0; i<n; i++)
+            ins[i] = del[i] = i;
+        if(dist == DIST_RANDOM || dist == DIST_ZIPF) {
+            shuffle(&ins[0], n);
+            shuffle(&del[0], n);
+        }
+        if(dist == DIST_ZIPF) z = new zipf_gen(n);
+        lo = 0;
+        hi = n;
+    }
+    ~workload() { delete z; }
+
+    int lookup(size_t i, size_t range) {
+        switch(dist) {
+        case DIST_SEQ: return i % range;
+        case DIST_ZIPF: return z->next(&seed) * 2654435761ul % range;
+        case DIST_WINDOW: return hi - 1 - xorshift(&seed) % (n/8 + 1);
+        }
+        return xorshift(&seed) % range;
+    }
+    // Returns the key, setting op to 0 (lookup), 1 (insert) or 2 (delete).
+    int mixed(size_t i, int *op) {
+        unsigned long r;
+
+        if(dist == DIST_WINDOW) {
+            *op = i % 4 < 2 ? i % 4 + 1 : 0;
+            if(*op == 1) return hi++;
+            if(*op == 2) return lo++;
+            return lookup(i, 0);
+        }
+        r = xorshift(&seed) % 10;
+        *op = r == 0 ? 1 : r == 1 ? 2 : 0;
+        if(dist == DIST_SEQ) return i % (2*n);
+        return lookup(i, 2*n);
+    }
+};
+
+// The trees under test, all over keys 0 .. 2n-1.
+struct rbop_impl {
+    static const char *name() { return "rbtree"; }
+    std::vector<ent> a;
+    void *root;
+    rbop_impl(size_t n) : a(2*n), root(&nil) {
+        for(size_t i=0; i<2*n; i++) a[i].n = i;
+    }
+    void insert(int k) { add_node(&root, &a[k], &rbinf); }
+    bool find(int k) { return lookup_node(root, &k, &rbinf) != &nil; }
+    void erase(int k) { del_node(&root, &k, &rbinf); }
+};
+struct hpp_impl {
+    static const char *name() { return "template"; }
+    std::vector<ent> a;
+    ent_tree t;
+    hpp_impl(size_t n) : a(2*n), t(&nil) {
+        for(size_t i=0; i<2*n; i++) a[i].n = i;
+    }
+    void insert(int k) { t.insert(&a[k]); }
+    bool find(int k) { return t.find(k) != &nil; }
+    void erase(int k) { t.erase(k); }
+};
+struct set_impl {
+    static const char *name() { return "std::set"; }
+    std::set<int> s;
+    set_impl(size_t) {}
+    void insert(int k) { s.insert(k); }
+    bool find(int k) { return s.find(k) != s.end(); }
+    void erase(int k) { s.erase(k); }
+};
+struct map_impl {
+    static const char *name() { return "std::map"; }
+    std::vector<ent> a;
+    std::map<int, ent *> m;
+    map_impl(size_t n) : a(2*n) {
+        for(size_t i=0; i<2*n; i++) a[i].n = i;
+    }
+    void insert(int k) { m[k] = &a[k]; }
+    bool find(int k) { return m.find(k) != m.end(); }
+    void erase(int k) { m.erase(k); }
+};
+
+static uint32_t percentile(std::vector<uint32_t> &lat, size_t n, double q) {
+    size_t k = (size_t)(q*(n-1));
+    std::nth_element(lat.begin(), lat.begin()+k, lat.begin()+n);
+    return lat[k];
+}
+
+/* Time ops calls of f, one clock read per op (so latencies include
+ * the read itself), and print one CSV row.
+ */
+template <class F>
+static void timed(const char *impl, int dist, size_t n, const char *op,
+                  size_t ops, std::vector<uint32_t> &lat, F f) {
+    uint64_t t0 = now_ns(), t = t0, t1;
+
+    for(size_t i=0; i<ops; i++) {
+        f(i);
+        t1 = now_ns();
+        lat[i] = t1 - t;
+        t = t1;
+    }
+    printf("%s,%s,%zu,%s,%zu,%.1f,%u,%u,%u\n", impl, dist_name[dist], n, op,
+           ops, (double)(t-t0)/ops, percentile(lat, ops, 0.5),
+           percentile(lat, ops, 0.99), percentile(lat, ops, 0.999));
+}
+
+template <class T>
+static int suite1(int dist, size_t n, std::vector<uint32_t> &lat) {
+    T t(n);
+    workload w(dist, n);
+    size_t hit = 0;
+
+    timed(T::name(), dist, n, "insert", n, lat,
+          [&](size_t i) { t.insert(w.ins[i]); });
+    timed(T::name(), dist, n, "lookup", n, lat,
+          [&](size_t i) { hit += t.find(w.lookup(i, n)); });
+    timed(T::name(), dist, n, "delete", n, lat,
+          [&](size_t i) { t.erase(w.del[i]); });
+    if(hit != n || t.find(w.ins[0])) {
+        fprintf(stderr, "%s: %zu of %zu lookups hit\n", T::name(), hit, n);
+        return 1;
+    }
+    for(size_t i=0; i<n; i++)
+        t.insert(w.ins[i]);
+    timed(T::name(), dist, n, "mixed", n, lat, [&](size_t i) {
+        int op, k = w.mixed(i, &op);
+        if(op == 1) t.insert(k);
+        else if(op == 2) t.erase(k);
+        else t.find(k);
+    });
+    return 0;
+}
+
+static int bench_suite(size_t max) {
+    std::vector<uint32_t> lat(max);
+
+    printf("impl,dist,size,op,ops,ns_per_op,p50_ns,p99_ns,p999_ns\n");
+    for(size_t n = 1000; n <= max; n *= 10)
+        for(int dist = 0; dist < NDIST; dist++)
+            if(suite1<rbop_impl>(dist, n, lat)
+                    || suite1<hpp_impl>(dist, n, lat)
+                    || suite1<set_impl>(dist, n, lat)
+                    || suite1<map_impl>(dist, n, lat))
+                return 1;
+    return 0;
+}
+
+static const struct {
+    const char *name;
+    int (*run)(size_t n);
+} benches[] = {
+    {"cxx", bench_cxx},
+    {"build", bench_build},
+    {"union", bench_union},
+    {"batch", bench_batch},
+    {"map", bench_map},
+    {"lookup", bench_lookup},
+    {"pool", bench_pool},
+    {"freeze", bench_freeze},
+    {"dedup", bench_dedup},
+    {"pq", bench_pq},
+    {"file", bench_file},
+    {"suite", bench_suite},
+};
+
+int main(int argc, char **argv) {
+    const char *name = argc >= 2 ? argv[1] : "all";
+    size_t n = argc >= 3 ? strtoull(argv[2], NULL, 0) : 1 << 20;
+    size_t i;
+    int ret = 0, found = 0;
+
+    if(argc >= 4) srandom(atoi(argv[3]));
+    for(i=0; i<sizeof(benches)/sizeof(benches[0]); i++) {
+        if(strcmp(name, "all") && strcmp(name, benches[i].name))
+            continue;
+        found = 1;
+        if( (ret = benches[i].run(n)))
+            return ret;
+    }
+    if(!found) {
+        fprintf(stderr, "usage: %s [name|all [N [seed]]]\n", argv[0]);
+        return 2;
+    }
+    return 0;
+}
@@ -0,0 +1,134 @@
+/*    Copyright (C) David M. Rogers, 2014
+ *
+ *    David M. Rogers <predictivestatmech@gmail.com>
+ *    Nonequilibrium Stat. Mech. Research Group
+ *    Department of Chemistry
+ *    University of South Florida
+ *
+ *    This file is part of rbtree.
+ *
+ *    rbtree is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    rbtree is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with rbtree.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "rbepoch.h"
+
+void epoch_init(rbepoch_t *e, void (*reclaim)(void *node, void *ctx),
+                void *ctx) {
+    int i;
+
+    e->global = 1;
+    for(i=0; i<RB_EPOCH_SLOTS; i++)
+        e->slot[i].epoch = 0;
+    e->nslot = 0;
+    pthread_mutex_init(&e->lock, NULL);
+    for(i=0; i<3; i++) {
+        e->limbo[i] = NULL;
+        e->n[i] = e->cap[i] = 0;
+    }
+    e->reclaim = reclaim;
+    e->ctx = ctx;
+}
+
+static size_t reclaim_all(rbepoch_t *e, int i) {
+    size_t k, n = e->n[i];
+
+    if(e->reclaim != NULL)
+        for(k=0; k<n; k++)
+            e->reclaim(e->limbo[i][k], e->ctx);
+    e->n[i] = 0;
+    return n;
+}
+
+void epoch_destroy(rbepoch_t *e) {
+    int i;
+
+    for(i=0; i<3; i++) {
+        reclaim_all(e, i);
+        free(e->limbo[i]);
+    }
+    pthread_mutex_destroy(&e->lock);
+}
+
+int epoch_register(rbepoch_t *e) {
+    int i = __atomic_fetch_add(&e->nslot, 1, __ATOMIC_RELAXED);
+
+    if(i < RB_EPOCH_SLOTS) return i;
+    fprintf(stderr, "epoch_register: out of slots\n");
+    return -1;
+}
+
+/* The seq_cst store orders the slot before any load of the root,
+ * so a collector that misses it cannot have seen an older root
+ * than this reader will.
+ */
+void epoch_enter(rbepoch_t *e, int slot) {
+    __atomic_store_n(&e->slot[slot].epoch,
+                     __atomic_load_n(&e->global, __ATOMIC_SEQ_CST),
+                     __ATOMIC_SEQ_CST);
+}
+
+void epoch_exit(rbepoch_t *e, int slot) {
+    __atomic_store_n(&e->slot[slot].epoch, 0, __ATOMIC_RELEASE);
+}
+
+int epoch_retire(rbepoch_t *e, void *node) {
+    void **x;
+    int i;
+
+    pthread_mutex_lock(&e->lock);
+    i = e->global % 3;
+    if(e->n[i] == e->cap[i]) {
+        x = realloc(e->limbo[i], (2*e->cap[i] + 64)*sizeof(void *));
+        if(x == NULL) {
+            pthread_mutex_unlock(&e->lock);
+            return -1;
+        }
+        e->limbo[i] = x;
+        e->cap[i] = 2*e->cap[i] + 64;
+    }
+    e->limbo[i][e->n[i]++] = node;
+    pthread_mutex_unlock(&e->lock);
+    return 0;
+}
+
+size_t epoch_collect(rbepoch_t *e) {
+    unsigned long g, s;
+    size_t n = 0;
+    int i, nslot;
+
+    pthread_mutex_lock(&e->lock);
+    g = e->global;
+    nslot = __atomic_load_n(&e->nslot, __ATOMIC_RELAXED);
+    if(nslot > RB_EPOCH_SLOTS) nslot = RB_EPOCH_SLOTS;
+    for(i=0; i<nslot; i++) {
+        s = __atomic_load_n(&e->slot[i].epoch, __ATOMIC_SEQ_CST);
+        if(s != 0 && s != g) goto out; // still in an older epoch
+    }
+    // every reader is in g or outside, so nodes retired in g-1 are gone
+    __atomic_store_n(&e->global, g+1, __ATOMIC_SEQ_CST);
+    n = reclaim_all(e, (g+2) % 3);
+out:
+    pthread_mutex_unlock(&e->lock);
+    return n;
+}
+
+void epoch_publish(void **root, void *N) {
+    __atomic_store_n(root, N, __ATOMIC_RELEASE);
+}
+
+void *epoch_root(void *const *root) {
+    return __atomic_load_n(root, __ATOMIC_ACQUIRE);
+}
@@ -0,0 +1,88 @@
+/*    Copyright (C) David M. Rogers, 2014
+ *
+ *    David M. Rogers <predictivestatmech@gmail.com>
+ *    Nonequilibrium Stat. Mech. Research Group
+ *    Department of Chemistry
+ *    University of South Florida
+ *
+ *    This file is part of rbtree.
+ *
+ *    rbtree is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    rbtree is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with rbtree.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _RBEPOCH_H
+#define _RBEPOCH_H
+
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Epoch-based reclamation for the nodes retired by padd_node and
+ * pdel_node, so that readers need no locks.
+ *
+ * Each reader thread takes a slot with epoch_register, and wraps
+ * every access (loading the root through the last use of a node)
+ * in epoch_enter / epoch_exit.  The writer retires nodes into the
+ * current epoch, and epoch_collect advances the epoch once every
+ * reader inside one has seen the current epoch.  Nodes retired
+ * two epochs back can no longer be reached, and go to reclaim.
+ *
+ * Only the writer should call epoch_collect, and only once the
+ * nodes it has retired are out of the published root.
+ *
+ * rbepoch_t is cache-line aligned; a static or automatic one is
+ * aligned by the compiler, but a heap one needs posix_memalign.
+ */
+#define RB_EPOCH_SLOTS 64
+
+typedef struct {
+    unsigned long epoch; // the epoch entered, or 0 outside
+} __attribute__((aligned(64))) rbslot_t; // one cache line each
+
+typedef struct {
+    unsigned long global;
+    rbslot_t slot[RB_EPOCH_SLOTS];
+    int nslot;
+    pthread_mutex_t lock; // for retiring and advancing
+    void **limbo[3]; // retired nodes, by epoch % 3
+    size_t n[3], cap[3];
+    void (*reclaim)(void *node, void *ctx);
+    void *ctx;
+} rbepoch_t;
+
+void epoch_init(rbepoch_t *e, void (*reclaim)(void *node, void *ctx),
+                void *ctx);
+// Reclaims everything still retired.  No reader may be inside.
+void epoch_destroy(rbepoch_t *e);
+
+// Returns a slot for one reader thread, or -1 if all are taken.
+int epoch_register(rbepoch_t *e);
+void epoch_enter(rbepoch_t *e, int slot);
+void epoch_exit(rbepoch_t *e, int slot);
+
+// Returns 0, or -1 if out of memory (node is then leaked).
+int epoch_retire(rbepoch_t *e, void *node);
+// Try to advance the epoch.  Returns the number of nodes reclaimed.
+size_t epoch_collect(rbepoch_t *e);
+
+// Publish (release) and take (acquire) a root.
+void epoch_publish(void **root, void *N);
+void *epoch_root(void *const *root);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
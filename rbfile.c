@@ -0,0 +1,197 @@
+/*    Copyright (C) David M. Rogers, 2014
+ *
+ *    David M. Rogers <predictivestatmech@gmail.com>
+ *    Nonequilibrium Stat. Mech. Research Group
+ *    Department of Chemistry
+ *    University of South Florida
+ *
+ *    This file is part of rbtree.
+ *
+ *    rbtree is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    rbtree is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with rbtree.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "rbfile.h"
+
+#define RB_FILE_MAGIC "rbtree1\n"
+#define NODES 64 // offset of the first node (one cache line)
+
+typedef struct {
+    char magic[8];
+    uint64_t n, size;
+    uint32_t root; // index, or RB_NIL_INDEX
+    uint32_t flags, coff, boff, soff, koff;
+    int32_t ktype;
+    unsigned char mask;
+} header_t;
+
+_Static_assert(sizeof(header_t) <= NODES, "header overlaps the nodes");
+
+// o as it links the nodes in a file (or mapping) at m.
+static void file_op(rbop_t *f, void *m, size_t size, const rbop_t *o) {
+    *f = *o;
+    f->flags |= RB_INDEX;
+    f->base = m + NODES;
+    f->stride = size;
+}
+
+static void set_header(header_t *h, size_t n, size_t size, uint32_t root,
+                       const rbop_t *o) {
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, RB_FILE_MAGIC, sizeof(h->magic));
+    h->n = n;
+    h->size = size;
+    h->root = root;
+    h->flags = o->flags | RB_INDEX;
+    h->coff = o->coff;
+    h->boff = o->boff;
+    h->soff = o->soff;
+    h->koff = o->koff;
+    h->ktype = o->ktype;
+    h->mask = o->mask;
+}
+
+// Links of lsize bytes, and every other field o uses, fit in size bytes.
+static int fits(size_t size, size_t lsize, const rbop_t *o) {
+    static const size_t key_size[] = {0, 4, 8, 8, sizeof(double)};
+
+    if(size == 0 || size < o->coff + lsize) return 0;
+    if(!(o->flags & RB_TAGGED) && size <= o->boff) return 0;
+    if((o->flags & RB_COUNT) && size < o->soff + sizeof(size_t)) return 0;
+    if(o->ktype > 0 && o->ktype <= RB_KEY_DOUBLE
+            && size < o->koff + key_size[o->ktype])
+        return 0;
+    return 1;
+}
+
+/* The nodes are copied straight into a writable mapping of the new
+ * file, then linked there by build_tree_sorted.  The file is only
+ * renamed into place once complete.
+ */
+int save_tree(const char *path, void *N, size_t size, const rbop_t *o) {
+    size_t n = 0, i, len = 0, lsize;
+    char *tmp = malloc(strlen(path) + 5);
+    void **nodes = NULL, *m = MAP_FAILED, *C, *R;
+    rbpath_t it;
+    rbop_t fo;
+    int fd = -1, ret = -1, err;
+
+    // the index links take less room than pointer links
+    lsize = o->flags & RB_INDEX ? 2*sizeof(uint32_t) : 2*sizeof(void *);
+    if(o->update != NULL // it would be handed the copy fo
+            || !fits(size, lsize, o)) {
+        errno = EINVAL;
+        goto out;
+    }
+    for(C = first_node(&it, N, o); C != o->nil; C = next_node(&it, o))
+        n++;
+    if(n >= RB_NIL_INDEX/2) { // RB_TAGGED needs the top bit
+        errno = EFBIG;
+        goto out;
+    }
+    if(tmp == NULL || (nodes = malloc(n*sizeof(void *) + 1)) == NULL)
+        goto out;
+    sprintf(tmp, "%s.tmp", path);
+    len = NODES + n*size;
+    if( (fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0
+            || ftruncate(fd, len) < 0
+            || (m = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED,
+                         fd, 0)) == MAP_FAILED)
+        goto out;
+
+    file_op(&fo, m, size, o);
+    C = first_node(&it, N, o);
+    for(i=0; i<n; i++, C = next_node(&it, o)) {
+        nodes[i] = fo.base + i*size;
+        memcpy(nodes[i], C, size);
+        memset(nodes[i] + o->coff, 0, lsize);
+    }
+    R = build_tree_sorted(nodes, n, &fo);
+    set_header(m, n, size, n ? (R - fo.base)/size : RB_NIL_INDEX, o);
+    if(msync(m, len, MS_SYNC) == 0 && rename(tmp, path) == 0)
+        ret = 0;
+out:
+    err = errno;
+    if(m != MAP_FAILED) munmap(m, len);
+    if(fd >= 0) {
+        close(fd);
+        if(ret) unlink(tmp);
+    }
+    free(nodes);
+    free(tmp);
+    errno = err;
+    return ret;
+}
+
+static int check_header(const header_t *h, size_t len, size_t size,
+                        const rbop_t *o) {
+    header_t want;
+
+    if(len < NODES) return -1;
+    set_header(&want, h->n, size, h->root, o);
+    if(memcmp(h, &want, sizeof(want)) != 0
+            || h->n > (len - NODES)/size
+            || (h->root >= h->n && h->root != RB_NIL_INDEX))
+        return -1;
+    return 0;
+}
+
+int map_tree(rbfile_t *f, const char *path, size_t size, const rbop_t *o) {
+    struct stat st;
+    header_t *h;
+    int fd, err;
+
+    if(o->update != NULL || !fits(size, 2*sizeof(uint32_t), o)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if( (fd = open(path, O_RDONLY)) < 0) return -1;
+    f->map = MAP_FAILED;
+    if(fstat(fd, &st) == 0 && st.st_size >= NODES)
+        f->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    else errno = EINVAL;
+    err = errno;
+    close(fd);
+    if(f->map == MAP_FAILED) {
+        errno = err;
+        return -1;
+    }
+    f->len = st.st_size;
+    h = f->map;
+    if(check_header(h, f->len, size, o)) {
+        fprintf(stderr, "map_tree: %s was saved with another layout\n", path);
+        unmap_tree(f);
+        errno = EINVAL;
+        return -1;
+    }
+    file_op(&f->op, f->map, size, o);
+    f->n = h->n;
+    f->root = h->root == RB_NIL_INDEX ? o->nil
+                                      : f->op.base + h->root*size;
+    return 0;
+}
+
+void unmap_tree(rbfile_t *f) {
+    munmap(f->map, f->len);
+    f->map = NULL;
+    f->len = f->n = 0;
+}
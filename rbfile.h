@@ -0,0 +1,72 @@
+/*    Copyright (C) David M. Rogers, 2014
+ *
+ *    David M. Rogers <predictivestatmech@gmail.com>
+ *    Nonequilibrium Stat. Mech. Research Group
+ *    Department of Chemistry
+ *    University of South Florida
+ *
+ *    This file is part of rbtree.
+ *
+ *    rbtree is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    rbtree is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with rbtree.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _RBFILE_H
+#define _RBFILE_H
+
+#include "rbtree.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A tree saved to a file that can be mapped read-only and
+ * searched in place, with no loading step.
+ *
+ * save_tree copies every node's size bytes (so the payload must
+ * hold no pointers) into the file in key order, and links them as
+ * a balanced RB_INDEX tree over that array.  Index links don't
+ * depend on where the array is mapped, and nil is RB_NIL_INDEX.
+ *
+ * map_tree maps the file and sets f->op to o plus RB_INDEX, with
+ * base at the mapped nodes.  Every call that only reads the tree
+ * works on f->root with &f->op: lookup_node(s), the bounds, cursors,
+ * foreach_range, and select_node/rank_node if o has RB_COUNT.
+ * The mapping is shared through the page cache, so many processes
+ * can map one file.  The layout of o (offsets, flags and key type)
+ * must match the one the file was saved with, on a machine of the
+ * same byte order.
+ *
+ * Trees with an update hook (such as rbival_t) can't be saved:
+ * the hook would be handed a copy of o, not the struct it is
+ * embedded in.  Both calls fail with EINVAL for them, and for
+ * a size that doesn't cover the links, color, count and key.
+ */
+typedef struct {
+    void *map;
+    size_t len, n;
+    void *root; // in the mapping, or o->nil
+    rbop_t op;
+} rbfile_t;
+
+// Returns 0, or -1 with errno set.
+int save_tree(const char *path, void *N, size_t size, const rbop_t *o);
+
+// Returns 0, or -1 (with errno set, or EINVAL for a file that doesn't match).
+int map_tree(rbfile_t *f, const char *path, size_t size, const rbop_t *o);
+void unmap_tree(rbfile_t *f);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,130 @@
+/*    Copyright (C) David M. Rogers, 2014
+ *
+ *    David M. Rogers <predictivestatmech@gmail.com>
+ *    Nonequilibrium Stat. Mech. Research Group
+ *    Department of Chemistry
+ *    University of South Florida
+ *
+ *    This file is part of rbtree.
+ *
+ *    rbtree is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    rbtree is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with rbtree.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include "rbfreeze.h"
+
+#define B RB_FROZEN_B
+
+// Half a block of keys (GCC vector extension, compiled to SIMD
+// compares where the target has them).
+typedef long long keyvec_t __attribute__((vector_size(B/2*sizeof(long long))));
+
+/* Baseline x86-64 has no 64-bit vector compare, so build an
+ * AVX2 version as well and pick one at load time.
+ */
+#if defined(__GNUC__) && defined(__x86_64__)
+#define MULTIVERSION __attribute__((target_clones("avx2", "default")))
+#else
+#define MULTIVERSION
+#endif
+
+static inline size_t child(size_t k, int i) {
+    return k*(B+1) + i + 1;
+}
+
+// Fill the keys under block k from the cursor, in order.
+static void fill(rbfrozen_t *f, size_t k, rbpath_t *it, void **C,
+                 long long (*key)(const void *node), const rbop_t *o) {
+    int i;
+
+    if(k >= f->nblock) return;
+    for(i=0; i<B; i++) {
+        fill(f, child(k, i), it, C, key, o);
+        f->node[k*B+i] = *C;
+        if(*C == o->nil) { // padding sorts last
+            f->key[k*B+i] = LLONG_MAX;
+            continue;
+        }
+        f->key[k*B+i] = key(*C);
+        *C = next_node(it, o);
+    }
+    fill(f, child(k, B), it, C, key, o);
+}
+
+int freeze_tree(rbfrozen_t *f, void *N, long long (*key)(const void *node),
+                const rbop_t *o) {
+    rbpath_t it;
+    void *C, *mem;
+
+    f->n = 0;
+    for(C = first_node(&it, N, o); C != o->nil; C = next_node(&it, o))
+        f->n++;
+    f->nblock = (f->n + B-1)/B;
+    f->nil = o->nil;
+    f->key = NULL;
+    f->node = malloc(f->nblock*B*sizeof(void *) + 1);
+    if(f->node == NULL || posix_memalign(&mem, B*sizeof(long long),
+                                f->nblock*B*sizeof(long long) + 1)) {
+        free(f->node);
+        return -1;
+    }
+    f->key = mem;
+    C = first_node(&it, N, o);
+    fill(f, 0, &it, &C, key, o);
+    return 0;
+}
+
+void free_frozen(rbfrozen_t *f) {
+    free(f->key);
+    free(f->node);
+    f->key = NULL;
+    f->node = NULL;
+    f->n = f->nblock = 0;
+}
+
+/* The slot of the first key >= x, or SIZE_MAX.
+ * Each block's rank is the count of its keys < x.
+ */
+MULTIVERSION
+static size_t lower_slot(const rbfrozen_t *f, long long x) {
+    size_t k = 0, res = SIZE_MAX;
+    keyvec_t lt;
+    int i, r;
+
+    while(k < f->nblock) {
+        lt = (*(const keyvec_t *)(f->key + k*B) < x) // -1 or 0 in each lane
+           + (*(const keyvec_t *)(f->key + k*B + B/2) < x);
+        for(i=r=0; i<B/2; i++)
+            r -= lt[i];
+        if(r < B) res = k*B + r;
+        k = child(k, r);
+    }
+    return res;
+}
+
+void *frozen_lookup(const rbfrozen_t *f, long long k) {
+    size_t s = lower_slot(f, k);
+
+    if(s == SIZE_MAX || f->key[s] != k) return f->nil;
+    return f->node[s];
+}
+
+void *frozen_lower_bound(const rbfrozen_t *f, long long k) {
+    size_t s = lower_slot(f, k);
+
+    return s == SIZE_MAX ? f->nil : f->node[s];
+}
@@ -0,0 +1,66 @@
+/*    Copyright (C) David M. Rogers, 2014
+ *
+ *    David M. Rogers <predictivestatmech@gmail.com>
+ *    Nonequilibrium Stat. Mech. Research Group
+ *    Department of Chemistry
+ *    University of South Florida
+ *
+ *    This file is part of rbtree.
+ *
+ *    rbtree is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    rbtree is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with rbtree.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _RBFREEZE_H
+#define _RBFREEZE_H
+
+#include "rbtree.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A read-only copy of a tree's order, for trees that are built
+ * once and then only searched.  Integer keys (from key(node),
+ * which must increase with o->cmp) are laid out as a static
+ * B-tree: blocks of RB_FROZEN_B keys fill one cache line, and
+ * block k has children k*(B+1)+1 ... k*(B+1)+B+1, so no links are
+ * stored.  Each block is searched with one vector compare, so a
+ * search touches one cache line per log_(B+1) n levels.
+ *
+ * The tree itself is not changed, and the frozen copy maps back
+ * to its nodes.  It goes stale once the tree is modified.
+ */
+#define RB_FROZEN_B 8
+
+typedef struct {
+    size_t n, nblock;
+    long long *key; // nblock*RB_FROZEN_B keys, cache-line aligned
+    void **node; // the node for each key, or nil for padding
+    void *nil;
+} rbfrozen_t;
+
+// Returns 0, or -1 if out of memory.
+int freeze_tree(rbfrozen_t *f, void *N, long long (*key)(const void *node),
+                const rbop_t *o);
+void free_frozen(rbfrozen_t *f);
+
+// The node with key k, or nil.
+void *frozen_lookup(const rbfrozen_t *f, long long k);
+// The first node with key >= k, or nil.
+void *frozen_lower_bound(const rbfrozen_t *f, long long k);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
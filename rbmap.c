@@ -0,0 +1,276 @@
+/*    Copyright (C) David M. Rogers, 2014
+ *
+ *    David M. Rogers <predictivestatmech@gmail.com>
+ *    Nonequilibrium Stat. Mech. Research Group
+ *    Department of Chemistry
+ *    University of South Florida
+ *
+ *    This file is part of rbtree.
+ *
+ *    rbtree is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    rbtree is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with rbtree.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rbmap.h"
+
+// A shard this much over the average (plus 50%) triggers a rebalance.
+#define RB_MAP_SLACK 64
+
+#define BOUND(m, i) ((m)->bound + (i)*(m)->node_size)
+
+int rbmap_init(rbmap_t *m, int nshard, size_t node_size, const rbop_t *o) {
+    int i;
+
+    m->o = o;
+    m->node_size = node_size;
+    m->nshard = nshard < 1 ? 1 : nshard;
+    m->nbound = 0;
+    m->version = 0;
+    m->total = 0;
+    m->rebalancing = 0;
+    m->shard = malloc(m->nshard*sizeof(rbshard_t));
+    m->bound = malloc(m->nshard*node_size);
+    if(m->shard == NULL || m->bound == NULL) {
+        free(m->shard);
+        free(m->bound);
+        return -1;
+    }
+    for(i=0; i<m->nshard; i++) {
+        pthread_rwlock_init(&m->shard[i].lock, NULL);
+        m->shard[i].root = o->nil;
+        m->shard[i].n = 0;
+    }
+    return 0;
+}
+
+void rbmap_free(rbmap_t *m, void (*fn)(void *node, void *ctx), void *ctx) {
+    int i;
+
+    for(i=0; i<m->nshard; i++) {
+        clear_tree(&m->shard[i].root, fn, ctx, m->o);
+        pthread_rwlock_destroy(&m->shard[i].lock);
+    }
+    free(m->shard);
+    free(m->bound);
+}
+
+// Index of the shard that should hold key A (NULL for the first).
+// Only call while holding some shard lock.
+static int find_shard(rbmap_t *m, const void *A) {
+    int lo = 0, hi = m->nbound, mid;
+
+    if(A == NULL) return 0;
+    while(lo < hi) {
+        mid = (lo+hi)/2;
+        if(compare_key(A, BOUND(m, mid), m->o) >= 0) lo = mid+1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static void lock(rbshard_t *s, int write) {
+    if(write) pthread_rwlock_wrlock(&s->lock);
+    else      pthread_rwlock_rdlock(&s->lock);
+}
+
+// Spread threads over shards for reading the bounds.
+static __thread int home = -1;
+static int next_home;
+
+/* Lock and return the shard that should hold A.
+ * The bounds are read while holding this thread's home shard,
+ * then the version is re-checked once the target is locked.
+ */
+static rbshard_t *lock_shard(rbmap_t *m, const void *A, int write) {
+    rbshard_t *s;
+    unsigned long v;
+    int h, i;
+
+    if(home < 0)
+        home = __atomic_fetch_add(&next_home, 1, __ATOMIC_RELAXED);
+    h = home % m->nshard;
+    for(;;) {
+        pthread_rwlock_rdlock(&m->shard[h].lock);
+        v = m->version;
+        i = find_shard(m, A);
+        if(i == h && !write) return m->shard+h;
+        pthread_rwlock_unlock(&m->shard[h].lock);
+        s = m->shard+i;
+        lock(s, write);
+        if(m->version == v) return s;
+        pthread_rwlock_unlock(&s->lock);
+    }
+}
+
+static int needs_rebalance(rbmap_t *m, size_t n, size_t total) {
+    size_t avg = total/m->nshard;
+    return n > avg + avg/2 + RB_MAP_SLACK;
+}
+
+void *rbmap_add(rbmap_t *m, void *A) {
+    rbshard_t *s = lock_shard(m, get_key(A, m->o), 1);
+    void *R = add_node(&s->root, A, m->o);
+    size_t n = 0, total = 0;
+    int idle = 0;
+
+    if(R == m->o->nil) {
+        n = ++s->n;
+        total = __atomic_add_fetch(&m->total, 1, __ATOMIC_RELAXED);
+    }
+    pthread_rwlock_unlock(&s->lock);
+
+    if(n && needs_rebalance(m, n, total)
+         && __atomic_compare_exchange_n(&m->rebalancing, &idle, 1, 0,
+                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        rbmap_rebalance(m);
+        __atomic_store_n(&m->rebalancing, 0, __ATOMIC_RELEASE);
+    }
+    return R;
+}
+
+void *rbmap_del(rbmap_t *m, const void *A) {
+    rbshard_t *s = lock_shard(m, A, 1);
+    void *R = del_node(&s->root, A, m->o);
+
+    if(R != m->o->nil) {
+        s->n--;
+        __atomic_sub_fetch(&m->total, 1, __ATOMIC_RELAXED);
+    }
+    pthread_rwlock_unlock(&s->lock);
+    return R;
+}
+
+void *rbmap_lookup(rbmap_t *m, const void *A) {
+    rbshard_t *s = lock_shard(m, A, 0);
+    void *R = lookup_node(s->root, A, m->o);
+
+    pthread_rwlock_unlock(&s->lock);
+    return R;
+}
+
+typedef struct {
+    const rbmap_t *m;
+    int (*fn)(void *node, void *ctx);
+    void *ctx;
+    void *last; // copy of the last node visited, if have_last
+    void *lastp; // the last node visited in the current shard
+    int have_last;
+} scan_t;
+
+static int scan_cb(void *node, void *ctx) {
+    scan_t *sc = ctx;
+
+    // resuming from last after a rebalance
+    if(sc->have_last && compare_key(get_key(node, sc->m->o), sc->last,
+                                    sc->m->o) <= 0)
+        return 0;
+    sc->lastp = node;
+    return sc->fn(node, sc->ctx);
+}
+
+int rbmap_range(rbmap_t *m, const void *lo, const void *hi,
+                int (*fn)(void *node, void *ctx), void *ctx) {
+    scan_t sc = { .m = m, .fn = fn, .ctx = ctx };
+    rbshard_t *s;
+    unsigned long v;
+    int i, ret, done;
+
+    if( (sc.last = malloc(m->node_size)) == NULL)
+        return -1;
+    s = lock_shard(m, lo, 0);
+    for(;;) {
+        i = s - m->shard;
+        v = m->version;
+        ret = foreach_range(s->root, sc.have_last ? get_key(sc.last, m->o)
+                                                  : lo, hi, scan_cb, &sc, m->o);
+        if(sc.lastp != NULL) { // the node may go once s is unlocked
+            memcpy(sc.last, sc.lastp, m->node_size);
+            sc.have_last = 1;
+            sc.lastp = NULL;
+        }
+        done = ret || i >= m->nbound
+                   || (hi != NULL && compare_key(hi, BOUND(m, i), m->o) < 0);
+        pthread_rwlock_unlock(&s->lock);
+        if(done) break;
+
+        s = m->shard+i+1;
+        pthread_rwlock_rdlock(&s->lock);
+        if(m->version != v) { // re-cut since: find our place again
+            pthread_rwlock_unlock(&s->lock);
+            s = lock_shard(m, sc.have_last ? get_key(sc.last, m->o) : lo, 0);
+        }
+    }
+    free(sc.last);
+    return ret;
+}
+
+// The k-th node of T (from 0).
+static void *nth_node(void *T, size_t k, const rbop_t *o) {
+    rbpath_t it;
+    void *C;
+
+    if(o->flags & RB_COUNT) return select_node(T, k, o);
+    for(C = first_node(&it, T, o); k > 0 && C != o->nil; k--)
+        C = next_node(&it, o);
+    return C;
+}
+
+/* Join every shard into one tree, then split it back apart
+ * at equal ranks.  This takes O(nshard log n) with RB_COUNT,
+ * and O(n) without.
+ */
+void rbmap_rebalance(rbmap_t *m) {
+    const rbop_t *o = m->o;
+    rbpath_t it;
+    void *T = o->nil, *K, *L, *R;
+    size_t total = 0, want;
+    int i;
+
+    for(i=0; i<m->nshard; i++)
+        pthread_rwlock_wrlock(&m->shard[i].lock);
+    for(i=0; i<m->nshard; i++)
+        total += m->shard[i].n;
+    if(total < (size_t)m->nshard) goto out;
+    m->version++;
+
+    for(i=0; i<m->nshard; i++) {
+        R = m->shard[i].root;
+        if(R == o->nil) continue;
+        if(T == o->nil) {
+            T = R;
+            continue;
+        }
+        K = first_node(&it, R, o);
+        del_node(&R, get_key(K, o), o);
+        T = rb_join(T, K, R, o);
+    }
+    for(i=0; i<m->nshard-1; i++) {
+        want = total/m->nshard + ((size_t)i < total%m->nshard);
+        K = nth_node(T, want, o);
+        rb_split(T, get_key(K, o), &L, &R, o);
+        m->shard[i].root = L;
+        m->shard[i].n = want;
+        memcpy(BOUND(m, i), K, m->node_size);
+        T = rb_join(o->nil, K, R, o);
+    }
+    m->shard[i].root = T;
+    m->shard[i].n = total/m->nshard;
+    m->nbound = m->nshard-1;
+    __atomic_store_n(&m->total, total, __ATOMIC_RELAXED);
+out:
+    for(i=m->nshard; i-- > 0; )
+        pthread_rwlock_unlock(&m->shard[i].lock);
+}
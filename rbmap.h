@@ -0,0 +1,92 @@
+/*    Copyright (C) David M. Rogers, 2014
+ *
+ *    David M. Rogers <predictivestatmech@gmail.com>
+ *    Nonequilibrium Stat. Mech. Research Group
+ *    Department of Chemistry
+ *    University of South Florida
+ *
+ *    This file is part of rbtree.
+ *
+ *    rbtree is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    rbtree is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with rbtree.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _RBMAP_H
+#define _RBMAP_H
+
+#include <pthread.h>
+#include "rbtree.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A concurrent ordered map, range-partitioned over nshard
+ * independent trees, each behind its own reader-writer lock.
+ *
+ * Shard i holds the nodes from bound i-1 up to (not including)
+ * bound i.  The bounds are node_size-byte copies of nodes,
+ * so o->cmp must only look at the node's own bytes.
+ * When a shard grows well past the average, the next add
+ * re-cuts all shards to equal sizes (faster with RB_COUNT).
+ *
+ * No call holds more than one shard lock except a rebalance,
+ * which write-locks every shard (in order) and bumps version.
+ * Readers find their shard while holding some shard lock, so
+ * the bounds never change under them.
+ *
+ * As with the plain tree, the map never frees nodes: a node
+ * returned by rbmap_del may still be in use by a concurrent
+ * rbmap_lookup caller until the application says otherwise.
+ */
+typedef struct {
+    pthread_rwlock_t lock;
+    void *root;
+    size_t n;
+} rbshard_t;
+
+typedef struct {
+    const rbop_t *o;
+    size_t node_size;
+    int nshard, nbound; // nbound is 0 until the first rebalance
+    rbshard_t *shard;
+    char *bound; // nshard-1 node copies
+    unsigned long version; // changed only with every shard locked
+    size_t total;
+    int rebalancing;
+} rbmap_t;
+
+// Returns 0 on success, or -1 if out of memory.
+int rbmap_init(rbmap_t *m, int nshard, size_t node_size, const rbop_t *o);
+// Calls fn (if not NULL) on every node, as in clear_tree.
+void rbmap_free(rbmap_t *m, void (*fn)(void *node, void *ctx), void *ctx);
+
+void *rbmap_add(rbmap_t *m, void *A); // returns replaced node or nil
+void *rbmap_del(rbmap_t *m, const void *A);
+void *rbmap_lookup(rbmap_t *m, const void *A);
+
+/* Calls fn on every node from lo to hi (inclusive, NULL for open)
+ * in order across all shards, read-locking one shard at a time
+ * (so fn must not modify the map).
+ * Returns the first nonzero value fn returns, or 0.
+ */
+int rbmap_range(rbmap_t *m, const void *lo, const void *hi,
+                int (*fn)(void *node, void *ctx), void *ctx);
+
+// Re-cut the shards to equal sizes.
+void rbmap_rebalance(rbmap_t *m);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
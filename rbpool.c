@@ -0,0 +1,113 @@
+/*    Copyright (C) David M. Rogers, 2014
+ *
+ *    David M. Rogers <predictivestatmech@gmail.com>
+ *    Nonequilibrium Stat. Mech. Research Group
+ *    Department of Chemistry
+ *    University of South Florida
+ *
+ *    This file is part of rbtree.
+ *
+ *    rbtree is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    rbtree is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with rbtree.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "rbpool.h"
+
+void pool_init(rbpool_t *p, size_t node_size, size_t per_chunk) {
+    // room for the free-list link, and keep nodes pointer-aligned
+    if(node_size < sizeof(void *)) node_size = sizeof(void *);
+    p->size = (node_size + sizeof(void *)-1) & ~(sizeof(void *)-1);
+    p->per_chunk = per_chunk < 1 ? 1 : per_chunk;
+    p->chunks = NULL;
+    p->next = p->end = NULL;
+    p->free = NULL;
+    p->live = 0;
+}
+
+static void free_chunks(rbchunk_t *c) {
+    rbchunk_t *x;
+
+    for(; c != NULL; c = x) {
+        x = c->next;
+        free(c);
+    }
+}
+
+void pool_destroy(rbpool_t *p) {
+    free_chunks(p->chunks);
+    pool_init(p, p->size, p->per_chunk);
+}
+
+static rbchunk_t *new_chunk(size_t size, size_t n) {
+    rbchunk_t *c = malloc(sizeof(rbchunk_t) + n*size);
+
+    if(c == NULL) return NULL;
+    c->next = NULL;
+    c->n = n;
+    return c;
+}
+
+void *pool_alloc(rbpool_t *p) {
+    rbchunk_t *c;
+    void *x;
+
+    if( (x = p->free) != NULL) {
+        p->free = *(void **)x;
+    } else {
+        if(p->next == p->end) {
+            if( (c = new_chunk(p->size, p->per_chunk)) == NULL)
+                return NULL;
+            c->next = p->chunks;
+            p->chunks = c;
+            p->next = (char *)(c+1);
+            p->end = p->next + c->n*p->size;
+        }
+        x = p->next;
+        p->next += p->size;
+    }
+    p->live++;
+    return x;
+}
+
+void pool_free(rbpool_t *p, void *node) {
+    *(void **)node = p->free;
+    p->free = node;
+    p->live--;
+}
+
+int pool_compact(rbpool_t *p, void **N, int order,
+                 void (*moved)(void *from, void *to, void *ctx),
+                 void *ctx, const rbop_t *o) {
+    rbchunk_t *c;
+    void *R;
+
+    if(p->live == 0) {
+        pool_destroy(p);
+        return 0;
+    }
+    if( (c = new_chunk(p->size, p->live)) == NULL)
+        return -1;
+    R = compact_tree(*N, c+1, p->size, order, moved, ctx, o);
+    if(R != (void *)(c+1)) { // empty tree, or RB_INDEX
+        free(c);
+        return -1;
+    }
+    *N = R;
+    free_chunks(p->chunks);
+    p->chunks = c;
+    p->next = p->end = (char *)(c+1) + c->n*p->size;
+    p->free = NULL;
+    return 0;
+}
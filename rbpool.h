@@ -0,0 +1,78 @@
+/*    Copyright (C) David M. Rogers, 2014
+ *
+ *    David M. Rogers <predictivestatmech@gmail.com>
+ *    Nonequilibrium Stat. Mech. Research Group
+ *    Department of Chemistry
+ *    University of South Florida
+ *
+ *    This file is part of rbtree.
+ *
+ *    rbtree is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    rbtree is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with rbtree.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _RBPOOL_H
+#define _RBPOOL_H
+
+#include "rbtree.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A slab allocator for fixed-size nodes.  Nodes are carved from
+ * chunks of per_chunk nodes, and freed ones are reused first.
+ * Nodes are only pointer-aligned: node_size is rounded up to a
+ * multiple of sizeof(void *), so nodes needing more alignment
+ * should pad their size to it.
+ *
+ * After enough churn, neighbors in the tree end up on unrelated
+ * pages.  pool_compact moves a whole tree into one fresh chunk
+ * in BFS or van Emde Boas order (see compact_tree).
+ */
+typedef struct rbchunk_s rbchunk_t;
+struct rbchunk_s {
+    rbchunk_t *next;
+    size_t n; // nodes follow
+};
+
+typedef struct {
+    size_t size, per_chunk;
+    rbchunk_t *chunks;
+    char *next, *end; // unused tail of the newest chunk
+    void *free; // freed nodes, linked through their first word
+    size_t live;
+} rbpool_t;
+
+void pool_init(rbpool_t *p, size_t node_size, size_t per_chunk);
+// Frees every chunk (and so every node).
+void pool_destroy(rbpool_t *p);
+
+void *pool_alloc(rbpool_t *p); // returns NULL if out of memory
+void pool_free(rbpool_t *p, void *node);
+
+/* Moves the nodes of *N into one new chunk in the given order
+ * (RB_BFS or RB_VEB), then releases all the old chunks, so every
+ * live node in the pool must be in *N.  moved is called as in
+ * compact_tree, and the old nodes stay readable until pool_compact
+ * returns.  Returns 0, or -1 on failure (out of memory, or RB_INDEX
+ * links), leaving everything as it was.
+ */
+int pool_compact(rbpool_t *p, void **N, int order,
+                 void (*moved)(void *from, void *to, void *ctx),
+                 void *ctx, const rbop_t *o);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,97 @@
+/*    Copyright (C) David M. Rogers, 2014
+ *
+ *    David M. Rogers <predictivestatmech@gmail.com>
+ *    Nonequilibrium Stat. Mech. Research Group
+ *    Department of Chemistry
+ *    University of South Florida
+ *
+ *    This file is part of rbtree.
+ *
+ *    rbtree is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    rbtree is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with rbtree.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "rbpq.h"
+
+void pq_init(rbpq_t *q, const rbop_t *o) {
+    q->root = q->min = q->max = o->nil;
+}
+
+void pq_sync(rbpq_t *q, const rbop_t *o) {
+    rbpath_t it;
+
+    q->min = first_node(&it, q->root, o);
+    q->max = last_node(&it, q->root, o);
+}
+
+void *pq_add(rbpq_t *q, void *A, const rbop_t *o) {
+    const void *K = get_key(A, o);
+    void *R;
+    int eq = (o->flags & RB_MULTI) != 0; // equal keys go after
+
+    if(q->root == o->nil) {
+        add_node(&q->root, A, o);
+        q->min = q->max = A;
+        return o->nil;
+    }
+    R = add_node(&q->root, A, o);
+    if(R != o->nil) { // replaced, in place
+        if(R == q->min) q->min = A;
+        if(R == q->max) q->max = A;
+    } else if(compare_key(K, q->min, o) < 0) q->min = A;
+    else if(compare_key(K, q->max, o) >= 1-eq) q->max = A;
+    return R;
+}
+
+// After removing R.
+static void *removed(rbpq_t *q, void *R, const rbop_t *o) {
+    if(R == q->min || R == q->max)
+        pq_sync(q, o);
+    return R;
+}
+
+void *pq_del(rbpq_t *q, const void *A, const rbop_t *o) {
+    return removed(q, del_node(&q->root, A, o), o);
+}
+
+void *pq_remove(rbpq_t *q, void *A, const rbop_t *o) {
+    return removed(q, remove_node(&q->root, A, o), o);
+}
+
+/* The end node C has no child toward dir, so its neighbor
+ * is the far end of its other subtree, or else its parent.
+ */
+static void *pop_end(rbpq_t *q, int dir, const rbop_t *o) {
+    rbpath_t it;
+    void *C, *S, *X;
+
+    C = dir < 0 ? first_node(&it, q->root, o) : last_node(&it, q->root, o);
+    if(C == o->nil) return C;
+    if( (S = child_node(C, -dir, o)) != o->nil) {
+        while( (X = child_node(S, dir, o)) != o->nil)
+            S = X;
+    } else S = it.n > 0 ? it.N[it.n-1] : o->nil;
+    if(del_node_at(&q->root, &it, o) == o->nil) return o->nil;
+    if(dir < 0) q->min = S;
+    else q->max = S;
+    if(q->root == o->nil) q->min = q->max = o->nil;
+    return C;
+}
+
+void *pop_min(rbpq_t *q, const rbop_t *o) {
+    return pop_end(q, -1, o);
+}
+
+void *pop_max(rbpq_t *q, const rbop_t *o) {
+    return pop_end(q, 1, o);
+}
@@ -0,0 +1,67 @@
+/*    Copyright (C) David M. Rogers, 2014
+ *
+ *    David M. Rogers <predictivestatmech@gmail.com>
+ *    Nonequilibrium Stat. Mech. Research Group
+ *    Department of Chemistry
+ *    University of South Florida
+ *
+ *    This file is part of rbtree.
+ *
+ *    rbtree is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    rbtree is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with rbtree.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _RBPQ_H
+#define _RBPQ_H
+
+#include "rbtree.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A tree used as a priority queue (for schedulers and timers),
+ * keeping pointers to its first and last nodes up to date,
+ * so peeking at either end is O(1).
+ *
+ * pq_add, pq_del and pq_remove act as add_node, del_node and
+ * remove_node, plus at most two comparisons against the ends.
+ * pop_min and pop_max take the end node off by walking its spine
+ * (no comparisons), and find the next end from there in O(1).
+ * With RB_MULTI, pop_min takes equal keys in the order they were added.
+ *
+ * Change the tree only through these calls (or call pq_sync).
+ */
+typedef struct {
+    void *root;
+    void *min, *max; // nil when empty
+} rbpq_t;
+
+void pq_init(rbpq_t *q, const rbop_t *o);
+void pq_sync(rbpq_t *q, const rbop_t *o); // re-find min and max
+
+void *pq_add(rbpq_t *q, void *A, const rbop_t *o);
+void *pq_del(rbpq_t *q, const void *A, const rbop_t *o);
+void *pq_remove(rbpq_t *q, void *A, const rbop_t *o);
+
+// Return the removed node, or nil if empty.
+void *pop_min(rbpq_t *q, const rbop_t *o);
+void *pop_max(rbpq_t *q, const rbop_t *o);
+
+static inline void *peek_min(const rbpq_t *q) { return q->min; }
+static inline void *peek_max(const rbpq_t *q) { return q->max; }
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
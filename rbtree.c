@@ -23,228 +23,712 @@
 
 // stdio is only really needed for printing error messages
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
 #include "rbtree.h"
 
+// Don't hand set operations on subtrees below this black-height
+// (about 2^h nodes) to another thread.
+#ifndef RB_PAR_HEIGHT
+#define RB_PAR_HEIGHT 10
+#endif
+
 /*****************  Red/Black Trees (in your data str) **************/
 
+/* Statistics are per-thread, so counting needs no atomics.
+ * STAT(x) runs x only with RB_STATS.
+ */
+#ifdef RB_STATS
+static __thread rbstats_t stats;
+static __thread unsigned long level; // of a lookup in progress
+#define STAT(x) do { x; } while(0)
+
+static void end_descent(unsigned long n) {
+    stats.descents++;
+    stats.depth += n;
+    if(n > stats.max_depth) stats.max_depth = n;
+    level = 0;
+}
+// Every node a lookup visited was compared against.
+static void end_lookup(int found) {
+    level += found;
+    stats.cmp += level;
+    end_descent(level);
+}
+#else
+#define STAT(x) do { } while(0)
+#endif
+
+void get_stats(rbstats_t *s, int reset) {
+#ifdef RB_STATS
+    if(s != NULL) *s = stats;
+    if(reset) memset(&stats, 0, sizeof(stats));
+#else
+    (void)reset;
+    if(s != NULL) memset(s, 0, sizeof(*s));
+#endif
+}
+
+/* With RB_TAGGED, the red/black bit is the low bit of the left link
+ * (which holds the index shifted up one with RB_INDEX).
+ */
+static void set_tag(void *N, int red, const rbop_t *o) {
+    uintptr_t *u = N + o->coff;
+    uint32_t *i = N + o->coff;
+    if(o->flags & RB_INDEX) i[0] = (i[0] & ~(uint32_t)1) | red;
+    else *u = (*u & ~(uintptr_t)1) | red;
+}
+
 static void color_red(void *N, const rbop_t *o) {
     unsigned char *u = N + o->boff;
-    *u |= o->mask;
+    if(o->flags & RB_TAGGED) set_tag(N, 1, o);
+    else *u |= o->mask;
 }
 static void color_black(void *N, const rbop_t *o) {
     unsigned char *u = N + o->boff;
-    *u &= ~(o->mask);
+    if(o->flags & RB_TAGGED) set_tag(N, 0, o);
+    else *u &= ~(o->mask);
 }
 // this only understands m zero (black) or nonzero (red)
 static void set_mask(void *N, const unsigned char m, const rbop_t *o) {
     if(m) color_red(N, o);
     else color_black(N, o);
 }
-// returns mask or 0
+// returns mask (1 with RB_TAGGED) or 0
 unsigned char get_mask(const void *N, const rbop_t *o) {
     const unsigned char *u = N + o->boff;
+    const uintptr_t *t = N + o->coff;
+    const uint32_t *i = N + o->coff;
+    if(o->flags & RB_TAGGED)
+        return (o->flags & RB_INDEX ? i[0] : *t) & 1;
     return *u & o->mask;
 }
 
+static uint32_t to_index(void *x, const rbop_t *o) {
+    if(x == o->nil) return RB_NIL_INDEX;
+    return (x - o->base) / o->stride;
+}
+static void *from_index(uint32_t i, const rbop_t *o) {
+    if(i == RB_NIL_INDEX) return o->nil;
+    return o->base + (size_t)i*o->stride;
+}
+// un-shift a tagged left index
+static uint32_t untag_index(uint32_t i) {
+    i >>= 1;
+    return i == RB_NIL_INDEX >> 1 ? RB_NIL_INDEX : i;
+}
+
 static void set_left(void *N, void *x, const rbop_t *o) {
-    void **u = N + o->coff;
-    *u = x;
+    uintptr_t *u = N + o->coff;
+    uint32_t *i = N + o->coff;
+    switch(o->flags & (RB_INDEX | RB_TAGGED)) {
+    case 0: *u = (uintptr_t)x; break;
+    case RB_INDEX: i[0] = to_index(x, o); break;
+    case RB_TAGGED: *u = (uintptr_t)x | (*u & 1); break;
+    default: i[0] = to_index(x, o) << 1 | (i[0] & 1);
+    }
 }
 static void set_right(void *N, void *x, const rbop_t *o) {
     void **u = N + o->coff + sizeof(void *);
-    *u = x;
+    uint32_t *i = N + o->coff;
+    if(o->flags & RB_INDEX) i[1] = to_index(x, o);
+    else *u = x;
 }
 static void *get_left(void *N, const rbop_t *o) {
-    void **u = N + o->coff;
-    return *u;
+    uintptr_t *u = N + o->coff;
+    uint32_t *i = N + o->coff;
+    switch(o->flags & (RB_INDEX | RB_TAGGED)) {
+    case 0: return (void *)*u;
+    case RB_INDEX: return from_index(i[0], o);
+    case RB_TAGGED: return (void *)(*u & ~(uintptr_t)1);
+    default: return from_index(untag_index(i[0]), o);
+    }
 }
 static void *get_right(void *N, const rbop_t *o) {
     void **u = N + o->coff + sizeof(void *);
+    uint32_t *i = N + o->coff;
+    if(o->flags & RB_INDEX) return from_index(i[1], o);
     return *u;
 }
+static void *get_child(void *N, int d, const rbop_t *o) {
+    return d < 0 ? get_left(N, o) : get_right(N, o);
+}
+static void set_child(void *N, int d, void *x, const rbop_t *o) {
+    if(d < 0) set_left(N, x, o);
+    else      set_right(N, x, o);
+}
+void *child_node(void *N, int dir, const rbop_t *o) {
+    return get_child(N, dir, o);
+}
+static int is_red(const void *N, const rbop_t *o) {
+    return N != o->nil && get_mask(N, o);
+}
 
+static size_t get_size(void *N, const rbop_t *o) {
+    size_t *u = N + o->soff;
+    return N == o->nil ? 0 : *u;
+}
 
-/* Magic internal data structure. */
-typedef struct rbtrav_s rbtrav_t;
-struct rbtrav_s {
-    rbtrav_t *up;
-    void *N;
-    int d; // direction taken from up to N
-};
+/* Keys.  With a key descriptor (o->ktype), searches take a bare key
+ * and compare it in-line with the typed field at N+koff; otherwise
+ * "keys" are nodes handed to o->cmp.  Everything that compares goes
+ * through compare_key, and node-vs-node comparisons use get_key on
+ * the first node.
+ */
+#define CMP3(T, K, x) ((*(const T *)(K) > *(const T *)(x)) \
+                      - (*(const T *)(K) < *(const T *)(x)))
 
-static int recurse_tree(void **rep, void *A, void *G, void *P, void *C,
-                    int dg, int dp, const rbop_t *o); // add
-static int pop_extreme(void **ret, const void *A, int dir, rbtrav_t *self,
-                    const rbop_t *o); // del
+int compare_key(const void *K, const void *N, const rbop_t *o) {
+    const void *x = N + o->koff;
 
+    STAT(stats.cmp++);
+    switch(o->ktype) {
+    case RB_KEY_INT32:  return CMP3(int32_t, K, x);
+    case RB_KEY_INT64:  return CMP3(int64_t, K, x);
+    case RB_KEY_UINT64: return CMP3(uint64_t, K, x);
+    case RB_KEY_DOUBLE: return CMP3(double, K, x);
+    default:            return o->cmp(K, N);
+    }
+}
 
-void *lookup_node(void *N, const void *A, const rbop_t *o) {
-    void *C = N;
-    int d;
-    
-    while(C != o->nil) {
-        N = C;
-        d = o->cmp(A, C);
-        if(d < 0) C = get_left(C, o);
-        else if(d > 0) C = get_right(C, o);
-        else break;
+const void *get_key(const void *N, const rbop_t *o) {
+    return o->ktype ? N + o->koff : N;
+}
+
+/* Augmented fields summarize a node's subtree, so they must be
+ * recomputed (bottom-up) whenever a node's children change.
+ * Structural changes pull every node on the path, and
+ * rotations then pull the two nodes they move (lower one first).
+ */
+#define AUGMENTED(o) (((o)->flags & RB_COUNT) || (o)->update != NULL)
+static void pull(void *N, const rbop_t *o) {
+    size_t *u;
+
+    if(o->flags & RB_COUNT) {
+        u = N + o->soff;
+        *u = get_size(get_left(N, o), o) + get_size(get_right(N, o), o) + 1;
     }
+    if(o->update != NULL)
+        o->update(N, o);
+}
+// pull the path above depth k
+static void pull_path(rbpath_t *p, int k, const rbop_t *o) {
+    if(!AUGMENTED(o)) return;
+    while(k-- > 0)
+        pull(p->N[k], o);
+}
+
+
+/* Magic internal data structure (rbpath_t, see rbtree.h).
+ *
+ * Without parent pointers, every operation that restructures the
+ * tree needs the way back up.  Rather than keep it on the call stack,
+ * the descent records it in an rbpath_t.  The extra slots past
+ * RB_MAX_DEPTH hold the current node and the one-level extension
+ * made by the red-sibling case of deletion.
+ */
+
+// Point the link into depth k of the path (from N[k-1] or the root) at x.
+static void relink(void **root, rbpath_t *p, int k, void *x,
+                   const rbop_t *o) {
+    if(k == 0) *root = x;
+    else set_child(p->N[k-1], p->d[k-1], x, o);
+}
+
+/* Copy-on-write state for the persistent add and del.
+ *
+ * Nodes are only ever modified in place once they are fresh,
+ * i.e. created by this operation (clones and the node being added),
+ * so the tree the operation started from is never touched.
+ * Every node dropped from the new version goes to retire.
+ * A NULL cow_t * means plain in-place operation.
+ */
+#define RB_MAX_FRESH (2*RB_MAX_DEPTH+8)
+typedef struct {
+    const rbcow_t *c;
+    void *fresh[RB_MAX_FRESH];
+    int n;
+} cow_t;
+
+static void add_fresh(cow_t *w, void *N) {
+    if(w->n < RB_MAX_FRESH) // else N may just be cloned twice
+        w->fresh[w->n++] = N;
+}
+static int is_fresh(cow_t *w, void *N) {
+    int i;
+
+    for(i=w->n; i-- > 0; )
+        if(w->fresh[i] == N) return 1;
+    return 0;
+}
+static void *clone_node(cow_t *w, void *N) {
+    void *X = w->c->clone(N, w->c->ctx);
+
+    add_fresh(w, X);
+    w->c->retire(N, w->c->ctx);
+    return X;
+}
+// Make the d-side child of (fresh) P safe to modify, and return it.
+static void *own(cow_t *w, void *P, int d, const rbop_t *o) {
+    void *C = get_child(P, d, o);
+
+    if(w == NULL || C == o->nil || is_fresh(w, C))
+        return C;
+    C = clone_node(w, C);
+    set_child(P, d, C, o);
     return C;
 }
+// Clone the path above depth k, leaving the new root in *root.
+static void own_path(void **root, rbpath_t *p, int k, cow_t *w,
+                     const rbop_t *o) {
+    int i;
 
-// Now the serious stuff.
-void *add_node(void **N, void *A, const rbop_t *o) {
-    void *R = o->nil;
-    int st, d;
-    
-    if(*N == o->nil) {
-        new_tree(A, o);
-        *N = A;
-        return o->nil;
+    for(i=0; i<k; i++) {
+        p->N[i] = clone_node(w, p->N[i]);
+        relink(root, p, i, p->N[i], o);
     }
+}
 
-    /*d = o->cmp(A, *N);
-    if(d < 0) R = get_left(*N, o);
-    else if(d > 0) R = get_right(*N, o);
-    else { // replaces root
-        R = *N;
-        color_black(A, o);
-        set_left(A, get_left(R, o), o);
-        set_right(A, get_right(R, o), o);
-        *N = A;
-        return R;
-    }*/
-    st = recurse_tree(&R, A, o->nil, (void *)N - o->coff, *N, 0, -1, o);
+#define MULTI(o) ((o)->flags & RB_MULTI)
+
+/* Walk down from N toward key A, recording the path.
+ * Returns the node comparing equal to A (or nil), which is also
+ * left in p->N[p->n].  With eq nonzero, equal nodes are passed on
+ * that side instead, so the walk always ends at nil.
+ * On overflow, p->n is set to -1.
+ */
+static void *descend(rbpath_t *p, void *N, const void *A, int eq,
+                     const rbop_t *o) {
+    void *C = N;
+    int d;
 
-    if(st) {
-        if(st == 1) {
-            color_black(*N, o); // Have been reddened, turn back!
+    p->n = 0;
+    while(C != o->nil) {
+        d = compare_key(A, C, o);
+        if(d == 0 && (d = eq) == 0) break;
+        if(p->n == RB_MAX_DEPTH) {
+            fprintf(stderr, "Path overflow -- is this a red-black tree?\n");
+            p->n = -1;
+            return o->nil;
+        }
+        p->N[p->n] = C;
+        if(d < 0) {
+            p->d[p->n++] = -1;
+            C = get_left(C, o);
         } else {
-            fprintf(stderr, "Unknown error in add_node "
-                        "-- is this a red-black tree?\n");
+            p->d[p->n++] = 1;
+            C = get_right(C, o);
         }
     }
-    return R;
+    p->N[p->n] = C;
+    STAT(end_descent(p->n + (C != o->nil)));
+    return C;
 }
 
+// Put A in place of the node at the end of the path.
+static void replace_at(void **root, rbpath_t *p, void *A,
+                       const rbop_t *o) {
+    void *C = p->N[p->n];
 
-/*  Red-black binary trees are implemented using a recursive,
- *  finite state machine that traverses the tree but
- *  back-tracks where necessary to achieve re-coloring.
- *  Keeping the last three nodes:
- *  G -dg-> P -dp-> C [current] (-d-> A[proposed])
- *  in memory keeps the number of states low.
- *
- * Starting state:
- *   0. initial traversal to addition point
- *   1. resuming a re-coloring
+    set_mask(A, get_mask(C, o), o);
+    set_left(A, get_left(C, o), o);
+    set_right(A, get_right(C, o), o);
+    if(AUGMENTED(o)) pull(A, o);
+    relink(root, p, p->n, A, o);
+    p->N[p->n] = A;
+}
+
+/*  The red node at depth k of the path may have a red parent.
+ *  Restore the red/black properties walking back up the path.
  *
- * Return value:
- *   0. done - return nil to caller
- *   1. re-color
- *   2. re-color, starting at parent
+ *  Keeping the last three nodes:
+ *  G -dp-> P -d-> C [red]
+ *  each step either re-colors (pushing the violation two levels up),
+ *  or rotates once or twice and stops.
  *
+ *  Returns 1 if the root had to be turned back to black
+ *  (raising the black-height of the tree), else 0.
+ *  With w, the path must already be fresh.
  */
-static int recurse_tree(void **rep, void *A, void *G, void *P, void *C,
-                 int dg, int dp, const rbop_t *o) {
-    void *N, *U;
-    int d, st;
-
-    d = o->cmp(A, C);
-    if(d < 0) N = get_left(C, o);
-    else if(d > 0) N = get_right(C, o);
-    else { // replacement case
-        if(dp < 0) set_left(P, A, o);
-        else      set_right(P, A, o);
-        set_mask(A, get_mask(C, o), o);
-        set_left(A, get_left(C, o), o);
-        set_right(A, get_right(C, o), o);
-        *rep = C;
-        return 0;
-    }
-    if(N != o->nil) {
-        st = recurse_tree(rep, A, P, C, N, dp, d, o);
-        switch(st) { // return cases
-            case 0:
-                return st;
-            case 1:
-                goto lbl1;
-            case 2:
-                return 1; // popping the stack once to get to lbl1
+static int fix_red(void **root, rbpath_t *p, int k, cow_t *w,
+                   const rbop_t *o) {
+    void *G, *P, *C, *U;
+    int dp;
+
+    for(C = p->N[k]; k > 0 && get_mask(p->N[k-1], o); ) {
+        P = p->N[k-1]; // red, so not the root
+        G = p->N[k-2];
+        dp = p->d[k-2];
+        U = get_child(G, -dp, o);
+        if(is_red(U, o)) { // case 1: re-color and continue at G
+            STAT(stats.add_case[1]++; stats.recolor += 3);
+            U = own(w, G, -dp, o);
+            color_black(P, o);
+            color_black(U, o);
+            color_red(G, o);
+            C = G;
+            k -= 2;
+            continue;
+        }
+        // have an inward-leaning chain P -d-> C of red nodes
+        if(p->d[k-1] != dp) { // case 2: rotate C above P
+            STAT(stats.add_case[2]++; stats.rot++);
+            set_child(P, -dp, get_child(C, dp, o), o);
+            set_child(C, dp, P, o);
+            set_child(G, dp, C, o);
+            if(AUGMENTED(o)) {
+                pull(P, o);
+                pull(C, o);
+            }
+            P = C;
+        }
+        // have an outward-leaning chain G -dp-> P -dp-> (red)
+        // case 3: rotate P above G
+        STAT(stats.add_case[3]++; stats.rot++; stats.recolor += 2);
+        set_child(G, dp, get_child(P, -dp, o), o);
+        set_child(P, -dp, G, o);
+        if(AUGMENTED(o)) {
+            pull(G, o);
+            pull(P, o);
         }
+        color_black(P, o);
+        color_red(G, o);
+        relink(root, p, k-2, P, o);
+        return 0;
     }
-    // begin actual insertion, replacing a black leaf-node somewhere.
-    color_red(A, o);
+    if(k > 0 || !get_mask(*root, o))
+        return 0;
+    STAT(stats.recolor++);
+    color_black(*root, o); // Have been reddened, turn back!
+    return 1;
+}
+
+// Insert A at the (nil) end of the path.
+static void insert_at(void **root, rbpath_t *p, void *A, cow_t *w,
+                      const rbop_t *o) {
     set_left(A, o->nil, o);
     set_right(A, o->nil, o);
-    if(d < 0) set_left(C, A, o);
-    if(d > 0) set_right(C, A, o);
-    N = A; // re-label child (don't ref. A below)
-
-lbl1: // just colored/inserted C -d-> N (red), check for violations
-    if(get_mask(C, o) == 0) { // black
-        return 0; // done.
-    }
-    if(dp < 0) {
-        U = get_right(P, o);
-        if(U != o->nil && get_mask(U, o)) { // red
-            //show_tree("case1", (Ast *)P, 0);
+    if(p->n == 0) {
+        color_black(A, o);
+        if(AUGMENTED(o)) pull(A, o);
+        *root = A;
+        return;
+    }
+    color_red(A, o);
+    set_child(p->N[p->n-1], p->d[p->n-1], A, o);
+    p->N[p->n] = A;
+    if(AUGMENTED(o)) {
+        pull(A, o);
+        pull_path(p, p->n, o);
+    }
+    fix_red(root, p, p->n, w, o);
+}
+
+/* Unlink the node at the end of the path.
+ *
+ * A node with two children is first swapped with the nearest
+ * leaf-side node on the opposite side from its parent (mostly
+ * random), so that the node actually removed has < 2 children.
+ * If that removed a black node, the subtree left in its place
+ * is one black short, and the deficit is walked up the path.
+ * With w, the path (including its end) must already be fresh.
+ * Returns 0, or -1 (having changed nothing) if the path overflows.
+ */
+static int unlink_at(void **root, rbpath_t *p, cow_t *w,
+                      const rbop_t *o) {
+    void *Z = p->N[p->n], *Y, *C, *P, *S, *SN, *SF;
+    int k = p->n, j, dir, dx, red;
+
+    if(get_left(Z, o) == o->nil || get_right(Z, o) == o->nil) {
+        C = get_left(Z, o);
+        if(C == o->nil) C = get_right(Z, o);
+        red = get_mask(Z, o);
+        relink(root, p, k, C, o);
+        j = k;
+    } else {
+        dir = (k == 0 || p->d[k-1] < 0) ? 1 : -1;
+        p->d[k] = dir;
+        j = k+1;
+        for(Y = own(w, Z, dir, o); get_child(Y, -dir, o) != o->nil;
+                    Y = own(w, Y, -dir, o)) {
+            if(j == RB_MAX_DEPTH) {
+                fprintf(stderr, "Path overflow -- is this a red-black tree?\n");
+                return -1;
+            }
+            p->N[j] = Y;
+            p->d[j++] = -dir;
+        }
+        C = get_child(Y, dir, o);
+        red = get_mask(Y, o);
+        set_child(p->N[j-1], p->d[j-1], C, o); // unlink Y
+        p->N[k] = Z;
+        replace_at(root, p, Y, o); // and put it in Z's place
+    }
+    pull_path(p, j, o);
+    if(red) { // removed red node
+        STAT(stats.del_case[0]++);
+        return 0;
+    }
+    if(is_red(C, o)) { // replaced black with red node
+        STAT(stats.del_case[0]++; stats.recolor++);
+        if(w != NULL)
+            C = j == 0 ? (*root = clone_node(w, C))
+                       : own(w, p->N[j-1], p->d[j-1], o);
+        color_black(C, o);
+        return 0;
+    }
+
+    // the subtree at depth j (below P) is one black short
+    while(j > 0) {
+        P = p->N[j-1];
+        dx = p->d[j-1];
+        S = own(w, P, -dx, o);
+        if(is_red(S, o)) { // case 2: rotate S above P
+            STAT(stats.del_case[2]++; stats.rot++; stats.recolor += 2);
+            set_child(P, -dx, get_child(S, dx, o), o);
+            set_child(S, dx, P, o);
+            relink(root, p, j-1, S, o);
+            if(AUGMENTED(o)) {
+                pull(P, o);
+                pull(S, o);
+            }
+            color_black(S, o);
             color_red(P, o);
-            color_black(C, o); color_black(U, o);
-            //show_tree("case1-fin", (Ast *)P, 1);
-            return 2; // popping the stack twice to get to lbl1
+            // extend the path through S
+            p->N[j-1] = S;
+            p->d[j-1] = dx;
+            p->N[j] = P;
+            p->d[j++] = dx;
+            S = own(w, P, -dx, o);
         }
-        // have an inward-leaning chain P -dp-> C -d-> N of red nodes
-        if(d > 0) { // move N up and rotate left
-            //show_tree("case2", (Ast *)P, 0);
-            set_left(P, N, o);
-            set_right(C, get_left(N, o), o);
-            set_left(N, C, o);
-            U = C; C = N; N = U; // swap(C, N);
-            //show_tree("case2-fin", (Ast *)P, 1);
-            //d  = -d;
+        SN = get_child(S, dx, o);
+        SF = get_child(S, -dx, o);
+        if(!is_red(SF, o)) {
+            if(!is_red(SN, o)) { // S{N,F} (black)
+                color_red(S, o);
+                if(get_mask(P, o)) { // case 4: P (red) -> P (black) done
+                    STAT(stats.del_case[4]++; stats.recolor += 2);
+                    color_black(P, o);
+                    return 0;
+                }
+                STAT(stats.del_case[3]++; stats.recolor++);
+                j--; // case 3: P is now short
+                continue;
+            }
+            // case 5: rotate SN (red) above S
+            STAT(stats.del_case[5]++; stats.rot++; stats.recolor += 2);
+            SN = own(w, S, dx, o);
+            set_child(S, dx, get_child(SN, -dx, o), o);
+            set_child(SN, -dx, S, o);
+            set_child(P, -dx, SN, o);
+            if(AUGMENTED(o)) {
+                pull(S, o);
+                pull(SN, o);
+            }
+            color_black(SN, o);
+            color_red(S, o);
+            SF = S;
+            S = SN;
         }
-        // have an outward-leaning chain G -dg-> P -dp-> C -d-> N of red nodes
-        //show_tree("case3", (Ast *)P, 0);
-        color_black(C, o); // right-rotate G - P - C
-        color_red(P, o);
-        if(dg < 0) set_left(G, C, o);
-        else      set_right(G, C, o);
-        set_left(P, get_right(C, o), o);
-        set_right(C, P, o);
-        //show_tree("case3-fin", (Ast *)C, 1);
-    } else { // as above, but now right <-> left
-        U = get_left(P, o);
-        if(U != o->nil && get_mask(U, o)) { // red
-            //show_tree("case1", (Ast *)P, 0);
-            color_red(P, o);
-            color_black(C, o); color_black(U, o);
-            //show_tree("case1-fin", (Ast *)P, 1);
-            return 2; // popping the stack twice to get to lbl1
+        // case 6: rotate S above P
+        STAT(stats.del_case[6]++; stats.rot++; stats.recolor += 3);
+        SF = own(w, S, -dx, o);
+        set_child(P, -dx, get_child(S, dx, o), o);
+        set_child(S, dx, P, o);
+        relink(root, p, j-1, S, o);
+        if(AUGMENTED(o)) {
+            pull(P, o);
+            pull(S, o);
         }
-        // have an inward-leaning chain P -dp-> C -d-> N of red nodes
-        if(d < 0) { // rotate right
-            //show_tree("case2", (Ast *)P, 0);
-            set_right(P, N, o);
-            set_left(C, get_right(N, o), o);
-            set_right(N, C, o);
-            U = C; C = N; N = U; // swap(C, N);
-            //show_tree("case2-fin", (Ast *)P, 1);
-            // d = -d;
-        } // left-rotate G - P - C
-        // have an outward-leaning chain G -dg-> P -dp-> C -d-> N of red nodes
-        //show_tree("case3", (Ast *)P, 0);
-        color_black(C, o);
-        color_red(P, o);
-        if(dg < 0) set_left(G, C, o);
-        else      set_right(G, C, o);
-        set_right(P, get_left(C, o), o);
-        set_left(C, P, o);
-        //show_tree("case3-fin", (Ast *)C, 1);
+        set_mask(S, get_mask(P, o), o);
+        color_black(P, o);
+        color_black(SF, o);
+        return 0;
     }
+    STAT(stats.del_case[1]++);
     return 0;
 }
 
+
+/* One comparison (and no call) per level for a typed key.
+ * With plain pointer links, the child is loaded straight
+ * from its computed offset.
+ */
+#define LOOKUP_TYPED(T) { \
+        const T k = *(const T *)A; \
+        T x; \
+        if(o->flags & (RB_INDEX | RB_TAGGED)) { \
+            while(C != o->nil && (x = *(const T *)(C + o->koff)) != k) { \
+                STAT(level++); \
+                C = get_child(C, k < x ? -1 : 1, o); \
+            } \
+            STAT(end_lookup(C != o->nil)); \
+            return C; \
+        } \
+        while(C != o->nil && (x = *(const T *)(C + o->koff)) != k) { \
+            STAT(level++); \
+            C = *(void **)(C + o->coff + (k < x ? 0 : sizeof(void *))); \
+        } \
+        STAT(end_lookup(C != o->nil)); \
+        return C; \
+    }
+
+void *lookup_node(void *N, const void *A, const rbop_t *o) {
+    void *C = N;
+    int d;
+
+    switch(o->ktype) {
+    case RB_KEY_INT32:  LOOKUP_TYPED(int32_t);
+    case RB_KEY_INT64:  LOOKUP_TYPED(int64_t);
+    case RB_KEY_UINT64: LOOKUP_TYPED(uint64_t);
+    case RB_KEY_DOUBLE: LOOKUP_TYPED(double);
+    }
+    while(C != o->nil) {
+        d = o->cmp(A, C);
+        if(d < 0) C = get_left(C, o);
+        else if(d > 0) C = get_right(C, o);
+        else break;
+        STAT(level++);
+    }
+    STAT(end_lookup(C != o->nil));
+    return C;
+}
+
+/* Up to RB_LOOKUP_GROUP descents run interleaved, each taking one
+ * step per round and prefetching the child it will visit next, so
+ * their cache misses overlap.  A finished lane starts the next key.
+ */
+void lookup_nodes(void *N, const void **keys, void **out, size_t n,
+                  const rbop_t *o) {
+    void *C[RB_LOOKUP_GROUP];
+    size_t k[RB_LOOKUP_GROUP], next;
+    int j, m, d;
+
+    for(m=next=0; m < RB_LOOKUP_GROUP && next < n; m++) {
+        C[m] = N;
+        k[m] = next++;
+    }
+    while(m > 0) {
+        for(j=0; j<m; ) {
+            if(C[j] != o->nil && (d = compare_key(keys[k[j]], C[j], o)) != 0) {
+                C[j] = d < 0 ? get_left(C[j], o) : get_right(C[j], o);
+                if(C[j] != o->nil) {
+                    __builtin_prefetch(C[j]);
+                    __builtin_prefetch(C[j] + o->coff);
+                    j++;
+                    continue;
+                }
+            }
+            out[k[j]] = C[j]; // found, or nil
+            if(next < n) {
+                C[j] = N;
+                k[j++] = next++;
+            } else { // retire the lane, moving the last one here
+                m--;
+                C[j] = C[m];
+                k[j] = k[m];
+            }
+        }
+    }
+}
+
+/* Find the closest node to A on side dir (or A itself, unless strict).
+ * B tracks the last node passed on the dir side of A.
+ */
+static void *bound_node(void *N, const void *A, int dir, int strict,
+                        const rbop_t *o) {
+    void *C = N, *B = o->nil;
+    int d;
+
+    while(C != o->nil) {
+        d = compare_key(A, C, o);
+        if(d == 0 && !strict) {
+            if(!MULTI(o)) return C;
+            d = -dir; // keep going, to the first (floor: last) equal node
+        }
+        if(dir > 0) {
+            if(d < 0) {
+                B = C;
+                C = get_left(C, o);
+            } else C = get_right(C, o);
+        } else {
+            if(d > 0) {
+                B = C;
+                C = get_right(C, o);
+            } else C = get_left(C, o);
+        }
+    }
+    return B;
+}
+
+void *floor_node(void *N, const void *A, const rbop_t *o) {
+    return bound_node(N, A, -1, 0, o);
+}
+void *ceil_node(void *N, const void *A, const rbop_t *o) {
+    return bound_node(N, A, 1, 0, o);
+}
+void *lower_bound(void *N, const void *A, const rbop_t *o) {
+    return bound_node(N, A, 1, 0, o);
+}
+void *upper_bound(void *N, const void *A, const rbop_t *o) {
+    return bound_node(N, A, 1, 1, o);
+}
+
+/* Returns the node replaced by A,
+ * nil if A was added, or A if it could not be.
+ */
+void *add_node(void **N, void *A, const rbop_t *o) {
+    rbpath_t p;
+    void *R;
+
+    R = descend(&p, *N, get_key(A, o), MULTI(o) ? 1 : 0, o);
+    if(p.n < 0) return A;
+    if(R != o->nil) { // replacement case
+        STAT(stats.replaced++);
+        replace_at(N, &p, A, o);
+        pull_path(&p, p.n, o);
+        return R;
+    }
+    insert_at(N, &p, A, NULL, o);
+    return o->nil;
+}
+
+/* One descent: if it ends at a node equal to A, merge into that
+ * (re-pulling the path, since update may read its payload),
+ * else insert A where the descent fell off.
+ */
+static void *find_or_merge(void **N, void *A,
+                           void (*merge)(void *E, void *A, void *ctx),
+                           void *ctx, const rbop_t *o) {
+    rbpath_t p;
+    void *E;
+
+    E = descend(&p, *N, get_key(A, o), 0, o);
+    if(p.n < 0) return o->nil;
+    if(E != o->nil) {
+        if(merge == NULL) return E;
+        merge(E, A, ctx);
+        if(o->update != NULL) {
+            pull(E, o);
+            pull_path(&p, p.n, o);
+        }
+        return E;
+    }
+    insert_at(N, &p, A, NULL, o);
+    return A;
+}
+
+void *find_or_add_node(void **N, void *A, const rbop_t *o) {
+    return find_or_merge(N, A, NULL, NULL, o);
+}
+
+void *upsert_node(void **N, void *A,
+                  void (*merge)(void *E, void *A, void *ctx), void *ctx,
+                  const rbop_t *o) {
+    return find_or_merge(N, A, merge, ctx, o);
+}
+
 // Setup node as root of a new tree.
 void new_tree(void *N, const rbop_t *o) {
     color_black(N, o);
@@ -252,289 +736,792 @@ void new_tree(void *N, const rbop_t *o) {
     set_right(N, o->nil, o);
 }
 
-// Store N in ret and walk up the stack with the replacement.
-// This ensures the node is consistently replaced everywhere.
-void replace_node(rbtrav_t *ret, void *N, const rbop_t *o) {
-    //printf("Replacing %s with %s\n", ((Ast *)ret->N)->name,
-    //                    ((Ast *)N)->name);
+/* Split at the middle, so that subtree sizes differ by at most one
+ * at every node.  That fills every level except the deepest, and
+ * coloring just that level red (when it isn't full) gives every
+ * path the same number of black nodes.
+ */
+static void *build_rec(void **nodes, size_t n, int depth, int red_depth,
+                       const rbop_t *o) {
+    size_t m = (n-1)/2;
+    void *C;
+
+    if(n == 0) return o->nil;
+    C = nodes[m];
+    set_left(C, build_rec(nodes, m, depth+1, red_depth, o), o);
+    set_right(C, build_rec(nodes+m+1, n-m-1, depth+1, red_depth, o), o);
+    set_mask(C, depth == red_depth, o);
+    if(AUGMENTED(o)) pull(C, o);
+    return C;
+}
 
-    // replace link with N
-    if(ret->d < 0) set_left(ret->up->N, N, o);
-    else          set_right(ret->up->N, N, o);
+void *build_tree_sorted(void **nodes, size_t n, const rbop_t *o) {
+    int h = 0;
 
-    set_mask(N, get_mask(ret->N, o), o); // put N in ret's place
-    set_left(N, get_left(ret->N, o), o);
-    set_right(N, get_right(ret->N, o), o);
-    ret->N = N;
+    while((n >> h) > 1) h++; // depth of the deepest level
+    if(((n+1) & n) == 0) h = -1; // n = 2^k - 1 fills every level
+    return build_rec(nodes, n, 0, h, o);
 }
 
-/*
-void print_stack(rbtrav_t *self, const rbop_t *o) {
-    for(; self->up != NULL; self=self->up) {
-        if(self->N == o->nil) {
-          printf("nil");
-        } else {
-          printf(" %s%c(%d)", ((Ast *)self->N)->name,
-                ' '+(get_mask(self->N, o)>0)*('*'-' '), self->d);
+/* The path only ever holds nodes whose subtrees are not yet
+ * finished, so a node is never read after fn has seen it.
+ */
+void clear_tree(void **N, void (*fn)(void *node, void *ctx), void *ctx,
+                const rbop_t *o) {
+    rbpath_t p;
+    void *C, *X;
+    int d;
+
+    if(*N == o->nil) return;
+    p.n = 0;
+    p.N[0] = *N;
+    for(;;) {
+        // descend to a node with no children, preferring the left
+        for(C = p.N[p.n]; ; p.N[++p.n] = C = X) {
+            if( (X = get_left(C, o)) != o->nil) d = -1;
+            else if( (X = get_right(C, o)) != o->nil) d = 1;
+            else break;
+            if(p.n == RB_MAX_DEPTH) {
+                fprintf(stderr, "Path overflow -- is this a red-black tree?\n");
+                return;
+            }
+            p.d[p.n] = d;
+        }
+        // C is finished: visit it, then climb until a right subtree is left
+        for(;;) {
+            if(fn != NULL) fn(C, ctx);
+            if(p.n == 0) {
+                *N = o->nil;
+                return;
+            }
+            C = p.N[--p.n];
+            if(p.d[p.n] < 0 && (X = get_right(C, o)) != o->nil) {
+                p.d[p.n] = 1;
+                p.N[++p.n] = X;
+                break;
+            }
         }
     }
-    printf("\n");
-}*/
+}
 
-/* deletion helper routine for node with <2 children
- * Note that these maintain the red/black property, and
- * so are not useful for simple/final listings.
- *
- * modes are:
- *  a) ret is location to put removed node
- *     A is comparison node key
- *     dir = 0 / undefined
- *  b) ret is location of node to replace with leaf
- *     A is nil
- *     dir = -1 (find smallest leaf) or +1 (find largest)
- *  
- *  for both modes, self points to the input stack
- *  {current node, direction taken to get there, and parent stack}
- *  and o, of course, defines the data structure.
+static void *seek_ceil(rbpath_t *it, void *N, const void *A,
+                       const rbop_t *o);
+
+// The path to the node equal to A (with RB_MULTI, the first of them).
+static void *find_path(rbpath_t *p, void *N, const void *A,
+                       const rbop_t *o) {
+    void *C;
+
+    if(!MULTI(o)) return descend(p, N, A, 0, o);
+    C = seek_ceil(p, N, A, o);
+    if(C == o->nil || compare_key(A, C, o) != 0) return o->nil;
+    return C;
+}
+
+/* Returns the node if deleted,
+ * nil if not present
  */
-// smallest <= dir < 0; largest <= dir > 0
-#define PARENT (self->up->N)
-#define DP (self->up->d)
-#define GRAND (self->up->up->N)
-static int pop_extreme(void **ret, const void *A, int dir,
-        rbtrav_t *self, const rbop_t *o) {
-    rbtrav_t next = { .up = self };
-    void *C, *S, *SL, *SR;
-    int d;
+void *del_node(void **N, const void *A, const rbop_t *o) {
+    rbpath_t p;
+    void *R;
 
-    if(ret == NULL) goto recall;
+    if(*N == o->nil || *N == NULL) return o->nil;
 
-    if(A != o->nil) { // initial descent to A
-        if(self->N == o->nil) { // not found
-            *ret = o->nil;
-            return 0;
-        }
-        d = o->cmp(A, self->N);
-        if(d != 0) {
-            if(d < 0) next.N = get_left(self->N, o);
-            else      next.N = get_right(self->N, o);
-            next.d = d;
-            if(pop_extreme(ret, A, 0, &next, o))
-                goto chk;
-            return 0;
-        }
-        //printf("Start replacement mode: ");
-        //print_stack(self, o);
-        // d = 0 case falls through to replacement mode start
-        *ret = self->N; // Return the deleted node in ret.
-
-        // Replace mode will replace P's link to N.
-        if(self->d < 0) {
-            ret = (void **)self;
-        } else {
-            ret = (void **)self;
-        }
-        SL = get_left(self->N, o);
-        SR = get_right(self->N, o);
-        // Replace nil (if present), then base try order on dp (mostly random).
-        if(SL == o->nil) {
-            d = get_mask(self->N, o);
-            C = SR;
-            goto replaceme;
-        } else if(SR == o->nil) {
-            d = get_mask(self->N, o);
-            C = SL;
-            goto replaceme;
-        } else {
-            dir = self->d;
-            if(dir < 0) next.N = get_right(self->N, o);
-            else        next.N = get_left(self->N, o);
-            next.d = -dir; // step opposite min/max direction dir.
-            if(pop_extreme(ret, o->nil, dir, &next, o))
-                goto chk;
-            return 0;
+    R = find_path(&p, *N, A, o);
+    if(R != o->nil && unlink_at(N, &p, NULL, o))
+        return o->nil;
+    return R;
+}
+
+// Among equal keys, step through them to find A itself.
+void *remove_node(void **N, void *A, const rbop_t *o) {
+    const void *K = get_key(A, o);
+    rbpath_t p;
+    void *C;
+
+    if(*N == o->nil || *N == NULL) return o->nil;
+
+    C = find_path(&p, *N, K, o);
+    while(C != A && C != o->nil && MULTI(o) && compare_key(K, C, o) == 0)
+        C = next_node(&p, o);
+    if(C != A || unlink_at(N, &p, NULL, o)) return o->nil;
+    return A;
+}
+
+/************** Persistent (path-copying) add and del ***************/
+
+void *padd_node(void *N, void *A, void **R, const rbcow_t *c,
+                const rbop_t *o) {
+    cow_t w = { .c = c, .n = 0 };
+    rbpath_t p;
+
+    *R = descend(&p, N, get_key(A, o), MULTI(o) ? 1 : 0, o);
+    if(p.n < 0) {
+        *R = A;
+        return N;
+    }
+    add_fresh(&w, A);
+    own_path(&N, &p, p.n, &w, o);
+    if(*R != o->nil) { // replacement case
+        STAT(stats.replaced++);
+        replace_at(&N, &p, A, o);
+        pull_path(&p, p.n, o);
+        c->retire(*R, c->ctx);
+        return N;
+    }
+    insert_at(&N, &p, A, &w, o);
+    return N;
+}
+
+void *pdel_node(void *N, const void *A, void **R, const rbcow_t *c,
+                const rbop_t *o) {
+    cow_t w = { .c = c, .n = 0 };
+    rbpath_t p;
+    void *Z;
+
+    *R = o->nil;
+    if(N == o->nil) return N;
+    if( (*R = find_path(&p, N, A, o)) == o->nil) return N;
+    // *R is copied too, since unlinking a node with two children
+    // writes to it.  The copy is dropped with it.
+    own_path(&N, &p, p.n+1, &w, o);
+    Z = p.N[p.n];
+    if(unlink_at(&N, &p, &w, o)) { // N is still a full copy, holding Z
+        *R = o->nil;
+        return N;
+    }
+    c->retire(Z, c->ctx);
+    return N;
+}
+
+/********************* In-order traversal ***************************/
+
+// Descend from the cursor's current node toward dir as far as possible.
+static void *run_down(rbpath_t *it, int dir, const rbop_t *o) {
+    void *C = it->N[it->n], *X;
+
+    while( (X = get_child(C, dir, o)) != o->nil) {
+        if(it->n == RB_MAX_DEPTH) {
+            fprintf(stderr, "Path overflow -- is this a red-black tree?\n");
+            break;
         }
-        A = o->nil;
+        it->d[it->n++] = dir;
+        it->N[it->n] = C = X;
     }
+    return C;
+}
 
-    // A = nil: descend to replacement leaf (dir has been set)
-    if(dir < 0) next.N = get_left(self->N, o);
-    else       next.N = get_right(self->N, o);
+// Step to the in-order neighbor in direction dir.
+static void *step(rbpath_t *it, int dir, const rbop_t *o) {
+    void *C;
 
-    if(next.N != o->nil) { // not there yet
-        next.d = dir;
-        if(pop_extreme(ret, o->nil, dir, &next, o))
-            goto chk;
-        return 0;
+    if(it->n < 0) return o->nil;
+    C = get_child(it->N[it->n], dir, o);
+    if(C != o->nil) { // one step dir, then all the way back
+        it->d[it->n++] = dir;
+        it->N[it->n] = C;
+        return run_down(it, -dir, o);
+    }
+    // climb until we come up from the -dir side
+    while(it->n > 0 && it->d[it->n-1] == dir)
+        it->n--;
+    if(it->n-- == 0) return o->nil;
+    return it->N[it->n];
+}
+
+static void *extreme(rbpath_t *it, void *N, int dir, const rbop_t *o) {
+    it->n = 0;
+    it->N[0] = N;
+    if(N == o->nil) {
+        it->n = -1;
+        return N;
     }
+    return run_down(it, dir, o);
+}
 
-    // there: N = extreme element to unlink (no child in direction = dir)
-    //  and sits in G -dp-> P -(self->d)-> N (-!dir-> C)?
-    if(dir < 0) C = get_right(self->N, o);
-    else        C = get_left(self->N, o);
+void *first_node(rbpath_t *it, void *N, const rbop_t *o) {
+    return extreme(it, N, -1, o);
+}
+void *last_node(rbpath_t *it, void *N, const rbop_t *o) {
+    return extreme(it, N, 1, o);
+}
+void *next_node(rbpath_t *it, const rbop_t *o) {
+    return step(it, 1, o);
+}
+void *prev_node(rbpath_t *it, const rbop_t *o) {
+    return step(it, -1, o);
+}
 
-    d = get_mask(self->N, o); // save N's old color
-    replace_node((rbtrav_t *)ret, self->N, o); // replace ret
-replaceme:
-    self->N = C; // replace N with child to continue algo.
-    if(self->d < 0) set_left(PARENT, C, o); // unlink N from P
-    else           set_right(PARENT, C, o);
-    //printf("Found replacement: ");
-    //print_stack(self, o);
+/* A goes just after the cursor's node H: as H's right child, or
+ * else left of H's successor S at the bottom of H's right subtree.
+ * Checking A against H and S (the last left turn on the path, if
+ * H has no right child) takes at most two comparisons.  Equal keys
+ * must come after H and before S, as add_node would place them.
+ */
+void *add_node_after(void **N, rbpath_t *it, void *A, const rbop_t *o) {
+    const void *K = get_key(A, o);
+    void *H, *S = o->nil;
+    int k;
 
-    if(d) // replaced red node
-        return 0;
-    if(C != o->nil && get_mask(C, o)) { // replaced black with red node
-        color_black(C, o);
-        return 0;
+    if(it->n < 0 || *N == o->nil) goto search;
+    H = it->N[it->n];
+    if(compare_key(K, H, o) < (MULTI(o) ? 0 : 1)) goto search;
+    if(get_right(H, o) != o->nil) {
+        step(it, 1, o);
+        S = it->N[it->n];
+        it->d[it->n++] = -1;
+    } else {
+        for(k = it->n; k > 0 && it->d[k-1] > 0; k--);
+        if(k > 0) S = it->N[k-1];
+        it->d[it->n++] = 1;
     }
-    // N isn't used past this point (except as parent from recursive call...)
-chk:
-    //printf("Checking: ");
-    //print_stack(self, o);
-    if(self->up->up == NULL) { // N is root.
-        return 0;
+    if(it->n > RB_MAX_DEPTH
+            || (S != o->nil && compare_key(K, S, o) >= 0))
+        goto search; // wrong hint (or path overflow)
+    insert_at(N, it, A, NULL, o);
+    it->n = -1;
+    return o->nil;
+search:
+    it->n = -1;
+    return add_node(N, A, o);
+}
+
+void *add_node_last(void **N, void *A, const rbop_t *o) {
+    rbpath_t it;
+
+    last_node(&it, *N, o);
+    return add_node_after(N, &it, A, o);
+}
+
+void *del_node_at(void **N, rbpath_t *it, const rbop_t *o) {
+    void *Z;
+
+    if(it->n < 0) return o->nil;
+    Z = it->N[it->n];
+    if(unlink_at(N, it, NULL, o)) Z = o->nil;
+    it->n = -1;
+    return Z;
+}
+
+/* Place the cursor on the first node not less than A.
+ * The path to it is the descent toward A cut back to
+ * the last place it turned left.  With RB_MULTI, the descent
+ * passes equal nodes on the left, to find the first of them.
+ */
+static void *seek_ceil(rbpath_t *it, void *N, const void *A,
+                       const rbop_t *o) {
+    void *C = descend(it, N, A, MULTI(o) ? -1 : 0, o);
+    if(C != o->nil || it->n < 0) return C;
+    while(it->n > 0 && it->d[it->n-1] > 0)
+        it->n--;
+    if(it->n-- == 0) return o->nil;
+    return it->N[it->n];
+}
+
+int foreach_range(void *N, const void *lo, const void *hi,
+                  int (*fn)(void *node, void *ctx), void *ctx,
+                  const rbop_t *o) {
+    rbpath_t it;
+    void *C;
+    int ret;
+
+    if(lo == NULL) C = first_node(&it, N, o);
+    else           C = seek_ceil(&it, N, lo, o);
+    for(; C != o->nil; C = next_node(&it, o)) {
+        if(hi != NULL && compare_key(hi, C, o) < 0)
+            break;
+        if( (ret = fn(C, ctx)))
+            return ret;
     }
-    if(self->d < 0) S = get_right(PARENT, o);
-    else           S =  get_left(PARENT, o);
-    if(S == o->nil) {
-        fprintf(stderr, "Algorithm error: sibling = nil\n");
-        return 0;
+    return 0;
+}
+
+/********************* Order statistics *****************************/
+
+void *select_node(void *N, size_t k, const rbop_t *o) {
+    size_t m;
+
+    if(!(o->flags & RB_COUNT)) {
+        fprintf(stderr, "select_node needs RB_COUNT\n");
+        return o->nil;
     }
-    if(S != o->nil && get_mask(S, o)) { // S (red)
-        //show_tree("case2.dot", (Ast *)PARENT, 0);
-        color_red(PARENT, o); // implies no recursive checking.
-        color_black(S, o);
-        if(self->d < 0) {
-            if(DP < 0) set_left(GRAND, S, o);
-            else      set_right(GRAND, S, o);
-            SL = get_left(S, o); // new S (black)
-            set_left(S, PARENT, o);
-            set_right(PARENT, SL, o);
+    while(N != o->nil) {
+        m = get_size(get_left(N, o), o);
+        if(k == m) break;
+        if(k < m) N = get_left(N, o);
+        else {
+            k -= m+1;
+            N = get_right(N, o);
         }
+    }
+    return N;
+}
+
+// number of nodes < A, or <= A if le
+static size_t rank_of(void *N, const void *A, int le, const rbop_t *o) {
+    size_t r = 0;
+    int d;
+
+    while(N != o->nil) {
+        d = compare_key(A, N, o);
+        if(d < 0 || (d == 0 && !le)) N = get_left(N, o);
         else {
-            if(DP < 0) set_left(GRAND, S, o);
-            else      set_right(GRAND, S, o);
-            SL = get_right(S, o); // new S (black)
-            set_right(S, PARENT, o);
-            set_left(PARENT, SL, o);
+            r += get_size(get_left(N, o), o) + 1;
+            if(d == 0 && !MULTI(o)) break;
+            N = get_right(N, o);
         }
-        //printf("Handled case 2.\n");
-        //show_tree("case2-fin.dot", (Ast *)S, 0);
-        // adds visit to S in stack by re-writing traversal
-        // and calling myself again
-        next.N = self->N; // delegate self's work to next level
-        // not set? since N isn't used anyway
-        next.d = self->d;
-        self->N = PARENT; // take over P's work
-        // self->d = self->d; (parent is in d direction from S)
-        // self->up->d = self->up->d; (S is in parent's direction from G)
-        PARENT = S; // visit S instead of G (parent stack still G)
-
-        if(pop_extreme(NULL, o->nil, 0, &next, o)) goto chk;
+    }
+    return r;
+}
+
+size_t rank_node(void *N, const void *A, const rbop_t *o) {
+    if(!(o->flags & RB_COUNT)) {
+        fprintf(stderr, "rank_node needs RB_COUNT\n");
         return 0;
-//recall:
-        //printf("Extended stack: ");
-        //print_stack(self, o);
-        //printf("Resuming (%s)\n", ((Ast *)self->N)->name);
-    }
-recall: // still checking.  ret, A and dir don't matter at this point.
-    if(self->d < 0) S = get_right(PARENT, o); // find new sibling
-    else             S = get_left(PARENT, o);
-
-    if(get_mask(S, o)) {
-        fprintf(stderr, "Red-black algo. error: S is not black!\n");
-        show_tree("err.dot", PARENT, 1);
+    }
+    return rank_of(N, A, 0, o);
+}
+
+size_t count_range(void *N, const void *lo, const void *hi,
+                   const rbop_t *o) {
+    size_t a, b;
+
+    if(!(o->flags & RB_COUNT)) {
+        fprintf(stderr, "count_range needs RB_COUNT\n");
         return 0;
     }
-    if(self->d < 0) {
-        SL = get_left(S, o);
-        SR = get_right(S, o);
-    } else {
-        SL = get_right(S, o);
-        SR = get_left(S, o);
-    }
-    if(SR == o->nil || get_mask(SR, o) == 0) {
-        color_red(S, o);
-        if(SL == o->nil || get_mask(SL, o) == 0) { // S{L,R} (black)
-            // S can be red.
-            if(get_mask(PARENT, o) == 0) { // P (black)
-                //printf("Handled case 3\n");
-                return 1;
-            } else {
-                color_black(PARENT, o); // P (red) -> P (black) done
-                //printf("Handled case 4\n");
+    a = lo == NULL ? 0 : rank_of(N, lo, 0, o);
+    b = hi == NULL ? get_size(N, o) : rank_of(N, hi, 1, o);
+    return b > a ? b-a : 0;
+}
+
+/********************* Interval trees *******************************/
+
+#define IVAL(N, off) (*(long long *)((void *)(N) + (off)))
+
+void ival_update(void *N, const rbop_t *o) {
+    const rbival_t *iv = (const rbival_t *)o;
+    long long m = IVAL(N, iv->hoff);
+    void *C;
+
+    if( (C = get_left(N, o)) != o->nil && IVAL(C, iv->moff) > m)
+        m = IVAL(C, iv->moff);
+    if( (C = get_right(N, o)) != o->nil && IVAL(C, iv->moff) > m)
+        m = IVAL(C, iv->moff);
+    IVAL(N, iv->moff) = m;
+}
+
+/* An in-order walk, skipping subtrees that end before lo,
+ * and stopping at the first node starting after hi.
+ */
+int ival_overlap(void *N, long long lo, long long hi,
+                 int (*fn)(void *node, void *ctx), void *ctx,
+                 const rbival_t *iv) {
+    const rbop_t *o = &iv->op;
+    void *stack[RB_MAX_DEPTH+2];
+    int n = 0, ret;
+
+    for(;;) {
+        for(; N != o->nil && IVAL(N, iv->moff) >= lo; N = get_left(N, o)) {
+            if(n == RB_MAX_DEPTH+2) {
+                fprintf(stderr, "Path overflow -- is this a red-black tree?\n");
                 return 0;
             }
-        } else { // S_L (red) S_R (black)
-            //show_tree("case5.dot", (Ast *)PARENT, 0);
-            color_black(SL, o);
-            if(self->d < 0) {
-                set_right(PARENT, SL, o);
-                set_left(S, get_right(SL, o), o);
-                set_right(SL, S, o);
-                SR = S;
-                S = SL;
-                SL = get_left(S, o);
-            } else {
-                set_left(PARENT, SL, o);
-                set_right(S, get_left(SL, o), o);
-                set_left(SL, S, o);
-                SR = S;
-                S = SL;
-                SL = get_right(S, o);
-            }
-            //show_tree("case5-fin.dot", (Ast *)PARENT, 0);
-            //printf("Handled case 5\n");
+            stack[n++] = N;
         }
+        if(n == 0) return 0;
+        N = stack[--n];
+        if(IVAL(N, iv->loff) > hi) return 0;
+        if(IVAL(N, iv->hoff) >= lo && (ret = fn(N, ctx)))
+            return ret;
+        N = get_right(N, o);
     }
-    if(get_mask(SR, o) == 0) {
-        fprintf(stderr, "Algorithm error: SR is not red!\n");
-        return 0;
+}
+
+/********************* Join-based set operations ********************/
+
+/* These all carry the black-height (black nodes on any path down
+ * from the node, nil excluded) of each subtree along with it,
+ * so that joining trees of heights hl, hr costs O(|hl - hr| + 1).
+ * Subtrees handed between them may have red roots.
+ */
+static int black_height(void *T, const rbop_t *o) {
+    int h = 0;
+
+    for(; T != o->nil; T = get_left(T, o))
+        h += !get_mask(T, o);
+    return h;
+}
+
+/* Link L < K < R, given the black-heights of L and R.
+ * Returns the root (black), and its black-height in *h.
+ */
+static void *join(void *L, int hl, void *K, void *R, int hr, int *h,
+                  const rbop_t *o) {
+    rbpath_t p;
+    void *T, *C, *X;
+    int dir, hc, target;
+
+    if(is_red(L, o)) {
+        color_black(L, o);
+        hl++;
+    }
+    if(is_red(R, o)) {
+        color_black(R, o);
+        hr++;
+    }
+    if(hl == hr) {
+        set_left(K, L, o);
+        set_right(K, R, o);
+        color_black(K, o);
+        if(AUGMENTED(o)) pull(K, o);
+        *h = hl+1;
+        return K;
+    }
+    if(hl > hr) { // walk down L's right spine
+        T = L; X = R;
+        dir = 1; hc = hl; target = hr;
+    } else { // walk down R's left spine
+        T = R; X = L;
+        dir = -1; hc = hr; target = hl;
+    }
+    // find the first black node as short as X
+    p.n = 0;
+    for(C = T; is_red(C, o) || hc > target; C = get_child(C, dir, o)) {
+        hc -= !get_mask(C, o);
+        p.N[p.n] = C;
+        p.d[p.n++] = dir;
+    }
+    // hang C and X from K (red) in C's place
+    set_child(K, -dir, C, o);
+    set_child(K, dir, X, o);
+    color_red(K, o);
+    relink(&T, &p, p.n, K, o);
+    p.N[p.n] = K;
+    if(AUGMENTED(o)) {
+        pull(K, o);
+        pull_path(&p, p.n, o);
+    }
+    *h = (hl > hr ? hl : hr) + fix_red(&T, &p, p.n, NULL, o);
+    return T;
+}
+
+/* Split T (black-height h) into nodes < A and nodes > A.
+ * Returns the node comparing equal to A, or nil.
+ */
+static void *split(void *T, int h, const void *A, void **L, int *hl,
+                   void **R, int *hr, const rbop_t *o) {
+    void *M, *X;
+    int d, hx;
+
+    if(T == o->nil) {
+        *L = *R = o->nil;
+        *hl = *hr = 0;
+        return o->nil;
+    }
+    h -= !get_mask(T, o); // now the children's height
+    d = compare_key(A, T, o);
+    if(d == 0) {
+        *L = get_left(T, o);
+        *R = get_right(T, o);
+        *hl = *hr = h;
+        return T;
     }
-    //show_tree("case6.dot", (Ast *)PARENT, 0);
-    //printf("Stack at start of case6: ");
-    //print_stack(self, o);
-    // rotate left at P
-    if(self->d < 0) {
-        if(DP < 0) set_left(GRAND, S, o);
-        else       set_right(GRAND, S, o);
-        set_right(PARENT, SL, o);
-        set_left(S, PARENT, o);
+    if(d < 0) {
+        M = split(get_left(T, o), h, A, L, hl, &X, &hx, o);
+        *R = join(X, hx, T, get_right(T, o), h, hr, o);
     } else {
-        if(DP < 0) set_left(GRAND, S, o);
-        else       set_right(GRAND, S, o);
-        set_left(PARENT, SL, o);
-        set_right(S, PARENT, o);
+        M = split(get_right(T, o), h, A, &X, &hx, R, hr, o);
+        *L = join(get_left(T, o), h, T, X, hx, hl, o);
+    }
+    return M;
+}
+
+// Remove the last node of T into *K.
+static void *split_last(void *T, int h, void **K, int *hl,
+                        const rbop_t *o) {
+    void *X;
+    int hx;
+
+    h -= !get_mask(T, o);
+    if(get_right(T, o) == o->nil) {
+        *K = T;
+        *hl = h;
+        return get_left(T, o);
     }
-    set_mask(S, get_mask(PARENT, o), o);
-    color_black(PARENT, o);
-    color_black(SR, o);
-    //printf("Handled case 6\n");
-    //show_tree("case6-fin.dot", (Ast *)S, 0);
+    X = split_last(get_right(T, o), h, K, &hx, o);
+    return join(get_left(T, o), h, T, X, hx, hl, o);
+}
+
+// Join L < R without a middle node.
+static void *join2(void *L, int hl, void *R, int hr, int *h,
+                   const rbop_t *o) {
+    void *K;
+
+    if(L == o->nil) {
+        *h = hr;
+        return R;
+    }
+    L = split_last(L, hl, &K, &hl, o);
+    return join(L, hl, K, R, hr, h, o);
+}
 
+void *rb_join(void *L, void *K, void *R, const rbop_t *o) {
+    int h;
+    return join(L, black_height(L, o), K, R, black_height(R, o), &h, o);
+}
+
+void *rb_split(void *N, const void *A, void **L, void **R,
+               const rbop_t *o) {
+    void *M;
+    int hl, hr;
+
+    M = split(N, black_height(N, o), A, L, &hl, R, &hr, o);
+    if(is_red(*L, o)) color_black(*L, o);
+    if(is_red(*R, o)) color_black(*R, o);
+    return M;
+}
+
+enum { RB_UNION, RB_INTERSECT, RB_DIFFERENCE };
+
+typedef struct {
+    int op;
+    const rbsetop_t *s;
+    const rbop_t *o;
+    int spare; // threads not yet in use
+    int par_height;
+} setctx_t;
+
+typedef struct {
+    setctx_t *c;
+    void *A, *B, *T;
+    int ha, hb, h;
+} setarg_t;
+
+static void drop(setctx_t *c, void *N) {
+    if(c->s != NULL && c->s->drop != NULL)
+        c->s->drop(N, c->s->ctx);
+}
+static void *drop_all(setctx_t *c, void *T, int *h) {
+    if(c->s != NULL && c->s->drop != NULL)
+        clear_tree(&T, c->s->drop, c->s->ctx, c->o);
+    *h = 0;
+    return c->o->nil;
+}
+
+static int take_thread(setctx_t *c) {
+    int n = __atomic_load_n(&c->spare, __ATOMIC_RELAXED);
+
+    while(n > 0) {
+        if(__atomic_compare_exchange_n(&c->spare, &n, n-1, 0,
+                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            return 1;
+    }
     return 0;
 }
 
-/* Returns the node if deleted,
- * nil if not present
+static void *setop(setctx_t *c, void *A, int ha, void *B, int hb, int *h);
+
+static void *setop_thread(void *arg) {
+    setarg_t *a = arg;
+    a->T = setop(a->c, a->A, a->ha, a->B, a->hb, &a->h);
+    return NULL;
+}
+
+/* Split A around B's root K, recurse on both sides (the left in a
+ * new thread if one is spare and the work is big enough), then
+ * join the results back together around K (or without it).
  */
-void *del_node(void **N, const void *A, const rbop_t *o) {
-    rbtrav_t prev, next;
-    void *R;
-   
-    if(*N == o->nil || *N == NULL) return o->nil;
+static void *setop(setctx_t *c, void *A, int ha, void *B, int hb,
+                   int *h) {
+    const rbop_t *o = c->o;
+    setarg_t l = { .c = c };
+    pthread_t th;
+    void *K = B, *M, *R1, *R;
+    int hr1, hr, par = 0;
+
+    if(B == o->nil) {
+        if(c->op == RB_INTERSECT) return drop_all(c, A, h);
+        *h = ha;
+        return A;
+    }
+    if(A == o->nil) {
+        if(c->op != RB_UNION) return drop_all(c, B, h);
+        *h = hb;
+        return B;
+    }
+    hb -= !get_mask(K, o);
+    l.B = get_left(K, o);
+    l.hb = hb;
+    R = get_right(K, o);
+    M = split(A, ha, get_key(K, o), &l.A, &l.ha, &R1, &hr1, o);
 
-    // Install a sentinel, hacked to look like root is its left child.
-    prev.up = NULL;
-    prev.N = (void *)N - o->coff;
-    prev.d = 0;
+    if(hb >= c->par_height && take_thread(c)) {
+        par = pthread_create(&th, NULL, setop_thread, &l) == 0;
+        if(!par) __atomic_add_fetch(&c->spare, 1, __ATOMIC_RELAXED);
+        else STAT(stats.forks++);
+    }
+    if(!par) setop_thread(&l);
+    R = setop(c, R1, hr1, R, hb, &hr);
+    if(par) {
+        pthread_join(th, NULL);
+        __atomic_add_fetch(&c->spare, 1, __ATOMIC_RELAXED);
+    }
+
+    if(M != o->nil) drop(c, M);
+    if(c->op == RB_UNION || (c->op == RB_INTERSECT && M != o->nil))
+        return join(l.T, l.h, K, R, hr, h, o);
+    drop(c, K);
+    return join2(l.T, l.h, R, hr, h, o);
+}
 
-    next.up = &prev;
-    next.N = *N;
-    next.d = -1;
+static void *set_op(int op, void *A, void *B, const rbsetop_t *s,
+                    const rbop_t *o) {
+    setctx_t c = { .op = op, .s = s, .o = o };
+    void *T;
+    int h;
 
-    pop_extreme(&R, A, 0, &next, o);
-    return R;
+    c.spare = s != NULL && s->threads > 1 ? s->threads-1 : 0;
+    c.par_height = s != NULL && s->par_height > 0 ? s->par_height
+                                                  : RB_PAR_HEIGHT;
+    T = setop(&c, A, black_height(A, o), B, black_height(B, o), &h);
+    if(is_red(T, o)) color_black(T, o);
+    return T;
+}
+
+void *rb_union(void *A, void *B, const rbsetop_t *s, const rbop_t *o) {
+    return set_op(RB_UNION, A, B, s, o);
+}
+void *rb_intersect(void *A, void *B, const rbsetop_t *s,
+                   const rbop_t *o) {
+    return set_op(RB_INTERSECT, A, B, s, o);
+}
+void *rb_difference(void *A, void *B, const rbsetop_t *s,
+                    const rbop_t *o) {
+    return set_op(RB_DIFFERENCE, A, B, s, o);
+}
+
+typedef struct {
+    void *head; // replaced nodes, chained through their left links
+    size_t n;
+    const rbop_t *o;
+} chain_t;
+
+static void chain_node(void *N, void *ctx) {
+    chain_t *c = ctx;
+
+    set_left(N, c->head, c->o);
+    c->head = N;
+    c->n++;
+}
+
+size_t add_nodes_sorted(void **N, void **batch, size_t n,
+                        const rbop_t *o) {
+    chain_t c = { .head = o->nil, .n = 0, .o = o };
+    rbsetop_t s = { .drop = chain_node, .ctx = &c, .threads = 1 };
+    size_t i, m;
+
+    if(n == 0) return 0;
+    for(i = 1, m = 0; i < n; i++) { // later duplicates win
+        if(compare_key(get_key(batch[i], o), batch[m], o) == 0)
+            chain_node(batch[m], &c);
+        else m++;
+        batch[m] = batch[i];
+    }
+    *N = rb_union(*N, build_tree_sorted(batch, m+1, o), &s, o);
+
+    for(i = 0; i < c.n; i++) {
+        batch[i] = c.head;
+        c.head = get_left(c.head, o);
+    }
+    return c.n;
+}
+
+/********************* Compaction ***********************************/
+
+typedef struct {
+    void *dst;
+    size_t stride, n;
+    void (*moved)(void *from, void *to, void *ctx);
+    void *ctx;
+    const rbop_t *o;
+} pack_t;
+
+static int height(void *N, const rbop_t *o) {
+    int l, r;
+
+    if(N == o->nil) return 0;
+    l = height(get_left(N, o), o);
+    r = height(get_right(N, o), o);
+    return 1 + (l > r ? l : r);
 }
 
+/* Copy N to the next free slot, and point the d link of the
+ * (already placed) parent P at it.  N is never read again,
+ * so moved may free it.
+ */
+static void *place(pack_t *k, void *N, void *P, int d) {
+    void *C = k->dst + k->n++ * k->stride;
+
+    memcpy(C, N, k->stride);
+    if(P != NULL) set_child(P, d, C, k->o);
+    if(k->moved != NULL) k->moved(N, C, k->ctx);
+    return C;
+}
+
+// The copies made so far double as the queue.
+static void pack_bfs(pack_t *k, void *N) {
+    void *C, *X;
+    size_t i;
+    int d;
+
+    place(k, N, NULL, 0);
+    for(i=0; i<k->n; i++) {
+        C = k->dst + i*k->stride;
+        for(d=-1; d<=1; d+=2)
+            if( (X = get_child(C, d, k->o)) != k->o->nil)
+                place(k, X, C, d);
+    }
+}
+
+static void *pack_veb(pack_t *k, void *N, void *P, int d, int h);
+
+// Lay out each subtree hanging from depth `depth` below (placed) C.
+static void pack_below(pack_t *k, void *C, int depth, int h) {
+    void *X;
+    int d;
+
+    for(d=-1; d<=1; d+=2) {
+        if( (X = get_child(C, d, k->o)) == k->o->nil) continue;
+        if(depth == 1) pack_veb(k, X, C, d, h);
+        else pack_below(k, X, depth-1, h);
+    }
+}
+
+/* Lay out the top h levels under N: the top half of them
+ * first (recursively), then every subtree below that.
+ */
+static void *pack_veb(pack_t *k, void *N, void *P, int d, int h) {
+    void *C;
+
+    if(h == 1) return place(k, N, P, d);
+    C = pack_veb(k, N, P, d, h/2);
+    pack_below(k, C, h/2, h - h/2);
+    return C;
+}
+
+void *compact_tree(void *N, void *dst, size_t stride, int order,
+                   void (*moved)(void *from, void *to, void *ctx),
+                   void *ctx, const rbop_t *o) {
+    pack_t k = { .dst = dst, .stride = stride, .n = 0,
+                 .moved = moved, .ctx = ctx, .o = o };
+
+    if(N == o->nil) return N;
+    if(o->flags & RB_INDEX) {
+        fprintf(stderr, "compact_tree: can't move RB_INDEX nodes\n");
+        return N;
+    }
+    if(order == RB_VEB) pack_veb(&k, N, NULL, 0, height(N, o));
+    else pack_bfs(&k, N);
+    return dst;
+}
@@ -20,23 +20,331 @@
  *    You should have received a copy of the GNU General Public License
  *    along with rbtree.  If not, see <http://www.gnu.org/licenses/>.
  */
+#ifndef _RBTREE_H
+#define _RBTREE_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 /* The cmp function operates between nodes (void *N)-s.
  * These must store L, R (void *)-s at N + coff.
  * The black (0) / red (1) bit is used at
  * the masked bit of N+boff.
+ *
+ * Optional features are turned on by flags:
+ *   RB_COUNT - keep a size_t count of the nodes in each subtree
+ *              at N+soff (enables select_node, rank_node, count_range).
+ *   RB_INDEX - store L, R as 32-bit indices (uint32_t at N + coff
+ *              and N + coff + 4) into the array of stride-byte nodes
+ *              at base, with RB_NIL_INDEX standing for nil (which
+ *              need not be in the array).  Every linked node must
+ *              then live in that array.
+ *   RB_TAGGED - keep the red/black bit in the low bit of the left
+ *              link instead of at boff/mask, so nodes need no
+ *              color field.  Nodes must be at least 2-byte aligned,
+ *              and with RB_INDEX, indices must be below 2^31 - 1.
+ *   RB_MULTI - keep nodes with equal keys, in the order they were
+ *              added, instead of replacing.  del_node removes the
+ *              first equal node, lookup_node finds any of them, and
+ *              the equal range runs from lower_bound to upper_bound
+ *              (or use foreach_range(A, A), count_range(A, A)).
+ *              Set operations, add_nodes_sorted and rbmap still
+ *              need distinct keys.
+ *
+ * Trees keyed by a single integer or double at N+koff can set ktype
+ * (RB_KEY_*) and leave cmp NULL.  Searches then compare
+ * in-line, and every key argument (the const void *A, lo, hi or keys
+ * of lookups, deletes, bounds, ranks and splits) points to a bare key
+ * of that type rather than to a node.  Double keys must not be NaN.
+ *
+ * If update is set, it is called on a node whenever its children
+ * change, children before parents, so it can recompute any
+ * summary of the node's subtree (see rbival_t for an example).
  */
-typedef struct {
+typedef struct rbop_s rbop_t;
+struct rbop_s {
     int (*cmp)(const void *, const void *);
     unsigned int coff, boff;
     unsigned char mask; // contains a one where red/black bit is set.
     void *nil;
-} rbop_t;
+    unsigned int flags;
+    unsigned int soff;
+    void (*update)(void *N, const rbop_t *o);
+    void *base; // for RB_INDEX
+    size_t stride;
+    unsigned int koff;
+    int ktype; // RB_KEY_NONE uses cmp
+};
+
+#define RB_COUNT 1
+#define RB_INDEX 2
+#define RB_TAGGED 4
+#define RB_MULTI 8
+
+#define RB_NIL_INDEX 0xFFFFFFFFu
+
+#define RB_KEY_NONE   0
+#define RB_KEY_INT32  1
+#define RB_KEY_INT64  2
+#define RB_KEY_UINT64 3
+#define RB_KEY_DOUBLE 4
+
+/* A path from the root: N[0] is the root, N[n] the current node,
+ * and d[i] the direction (-1 left, +1 right) taken from N[i].
+ * A red/black tree of n nodes is at most 2 log2(n+1) deep, so
+ * RB_MAX_DEPTH covers any tree that fits in memory.
+ *
+ * Since nodes have no parent pointers, this doubles as the
+ * in-order cursor.
+ */
+#define RB_MAX_DEPTH (2*8*(int)sizeof(void *))
+typedef struct {
+    void *N[RB_MAX_DEPTH+2];
+    signed char d[RB_MAX_DEPTH+2];
+    int n;
+} rbpath_t;
 
 void new_tree(void *N, const rbop_t *o);
+/* add_node returns the node A replaced, or nil if A was added.
+ * del_node returns the node it unlinked, or nil if none matched.
+ * A tree too deep to be red/black (RB_MAX_DEPTH, so corrupt) is
+ * left unchanged: the adds then return A itself, the dels nil.
+ */
 void *add_node(void **N, void *A, const rbop_t *o);
 void *del_node(void **N, const void *A, const rbop_t *o);
+// Removes node A itself (not just an equal one), or returns nil.
+void *remove_node(void **N, void *A, const rbop_t *o);
+
+/* Insert-if-absent in a single descent.  If a node E equal to A
+ * is present, find_or_add_node leaves it untouched and returns it,
+ * and upsert_node first calls merge(E, A, ctx), which may change
+ * E's payload but not its key.  Otherwise both add A and return A
+ * (so the caller still owns A unless the result is A), or nil
+ * for a corrupt tree.  With RB_MULTI, E is any one of the equal nodes.
+ */
+void *find_or_add_node(void **N, void *A, const rbop_t *o);
+void *upsert_node(void **N, void *A,
+                  void (*merge)(void *E, void *A, void *ctx), void *ctx,
+                  const rbop_t *o);
+
+/* Operation counters for the calling thread.  They are only kept
+ * when rbtree.c is compiled with -DRB_STATS; otherwise they stay
+ * zero and counting costs nothing.
+ *
+ * Cases are numbered as in the comments of rbtree.c: add_case 1 is
+ * a re-color, 2 and 3 rotations; del_case 0 needs no rebalancing
+ * (a red node went, or a red child took its place), 1 is a deficit
+ * reaching the root, and 2-6 the rest.  Descents are the lookups,
+ * adds and dels, with depth the total number of nodes compared
+ * against (so the mean depth is depth/descents).
+ */
+typedef struct {
+    unsigned long cmp; // key comparisons
+    unsigned long rot; // single rotations
+    unsigned long recolor; // color changes while rebalancing
+    unsigned long add_case[4], del_case[7];
+    unsigned long descents, depth, max_depth;
+    unsigned long replaced; // adds that replaced an equal node
+    unsigned long forks; // threads started by set operations
+} rbstats_t;
+
+// Copies the counters to s (if not NULL); with reset, zeroes them.
+void get_stats(rbstats_t *s, int reset);
+
+/* Persistent (path-copying) add and del.  Neither modifies any
+ * node reachable from N: each node they need to change is first
+ * copied with clone, so N stays a valid snapshot.  They return
+ * the root of the new version, and leave the replaced or deleted
+ * node (or nil) in *R (A itself if a corrupt tree left A out).  Only the path and a few of its siblings
+ * are copied, so each call makes O(log n) clones.
+ *
+ * Every node dropped from the new version -- originals that were
+ * copied, *R, and any copy that ended up unused -- is passed to
+ * retire.  Readers of older versions may still hold them, so
+ * retire should hand them to an epoch reclaimer (see rbepoch.h).
+ *
+ * Writers must be serialized.  Once the new root is published
+ * with an atomic store, readers can lookup_node (or walk with
+ * cursors) from any root they loaded, without locks.
+ */
+typedef struct {
+    void *(*clone)(const void *N, void *ctx); // copy N into new storage
+    void (*retire)(void *N, void *ctx);
+    void *ctx;
+} rbcow_t;
+
+void *padd_node(void *N, void *A, void **R, const rbcow_t *c,
+                const rbop_t *o);
+void *pdel_node(void *N, const void *A, void **R, const rbcow_t *c,
+                const rbop_t *o);
+
+/* Links n nodes, already in strictly increasing order, into a
+ * balanced red/black tree in one pass with no comparisons.
+ * Returns the new root.
+ */
+void *build_tree_sorted(void **nodes, size_t n, const rbop_t *o);
+
+/* Calls fn (if not NULL) on every node in post-order, so fn may
+ * free the node, then sets *N to nil.  Nothing is rebalanced.
+ */
+void clear_tree(void **N, void (*fn)(void *node, void *ctx), void *ctx,
+                const rbop_t *o);
 void *lookup_node(void *N, const void *A, const rbop_t *o);
 
-// returns mask or 0
+/* Sets out[i] = lookup_node(N, keys[i], o) for i < n, running many
+ * descents at once to hide memory latency on large trees.
+ */
+#define RB_LOOKUP_GROUP 16
+void lookup_nodes(void *N, const void **keys, void **out, size_t n,
+                  const rbop_t *o);
+
+/* Nearest-node searches, in one descent.  Each returns nil if
+ * there is no such node.
+ *   floor_node:  last node <= A
+ *   ceil_node:   first node >= A
+ *   lower_bound: first node >= A (same as ceil_node)
+ *   upper_bound: first node > A
+ */
+void *floor_node(void *N, const void *A, const rbop_t *o);
+void *ceil_node(void *N, const void *A, const rbop_t *o);
+void *lower_bound(void *N, const void *A, const rbop_t *o);
+void *upper_bound(void *N, const void *A, const rbop_t *o);
+
+/* In-order cursors.  These return the node the cursor moved to,
+ * or nil (leaving the cursor exhausted) when it runs off the end.
+ * Any add or del invalidates the cursor.
+ */
+void *first_node(rbpath_t *it, void *N, const rbop_t *o);
+void *last_node(rbpath_t *it, void *N, const rbop_t *o);
+void *next_node(rbpath_t *it, const rbop_t *o);
+void *prev_node(rbpath_t *it, const rbop_t *o);
+
+/* Updates at a cursor, with no search from the root.
+ * add_node_after adds A just after the cursor's node, and
+ * add_node_last after the last node (walking the right spine,
+ * with no comparisons), so appending keys in order costs O(1)
+ * amortized rebalancing.  If A doesn't belong there, both fall
+ * back to add_node (and return what it does).
+ * del_node_at unlinks the cursor's node and returns it (or nil for
+ * an exhausted cursor).  Both leave the cursor exhausted.
+ */
+void *add_node_after(void **N, rbpath_t *it, void *A, const rbop_t *o);
+void *add_node_last(void **N, void *A, const rbop_t *o);
+void *del_node_at(void **N, rbpath_t *it, const rbop_t *o);
+
+/* Calls fn on every node from lo to hi (inclusive) in order.
+ * A NULL lo or hi leaves that end open.  Stops early and
+ * returns the first nonzero value fn returns, or 0.
+ */
+int foreach_range(void *N, const void *lo, const void *hi,
+                  int (*fn)(void *node, void *ctx), void *ctx,
+                  const rbop_t *o);
+
+/* Order statistics (need RB_COUNT).
+ * select_node returns the k-th smallest node (from 0), or nil.
+ * rank_node returns the number of nodes < A.
+ * count_range returns the number of nodes from lo to hi (inclusive),
+ * where a NULL lo or hi leaves that end open.
+ */
+void *select_node(void *N, size_t k, const rbop_t *o);
+size_t rank_node(void *N, const void *A, const rbop_t *o);
+size_t count_range(void *N, const void *lo, const void *hi,
+                   const rbop_t *o);
+
+/* Interval trees: nodes hold closed intervals [lo, hi] of long long
+ * at N+loff and N+hoff, and ival_update keeps the largest hi in
+ * each subtree at N+moff.  Set op.update = ival_update, and use an
+ * op.cmp that orders nodes by lo first.
+ */
+typedef struct {
+    rbop_t op; // must come first
+    unsigned int loff, hoff, moff;
+} rbival_t;
+
+void ival_update(void *N, const rbop_t *o);
+
+/* Calls fn on every node overlapping [lo, hi] in order of lo.
+ * Stops early and returns the first nonzero value fn returns, or 0.
+ */
+int ival_overlap(void *N, long long lo, long long hi,
+                 int (*fn)(void *node, void *ctx), void *ctx,
+                 const rbival_t *iv);
+
+/* Join-based set operations.  These take whole trees apart and
+ * link the nodes into the result, so the input roots are no longer
+ * valid trees afterwards.  For inputs of sizes m <= n they take
+ * O(m log(n/m + 1)) work.
+ *
+ * rb_join links L < K < R.
+ * rb_split divides N into L (nodes < A) and R (nodes > A), and
+ * returns the node comparing equal to A, or nil.
+ * rb_union, rb_intersect and rb_difference return A | B, A & B
+ * and A - B.  Where both trees hold equal nodes, the one from B
+ * is kept.
+ */
+typedef struct {
+    // Called (if not NULL) on each node left out of the result.
+    // May be called from several threads at once.
+    void (*drop)(void *node, void *ctx);
+    void *ctx;
+    int threads; // split work over up to this many threads
+    // Fork only for subtrees of at least this black-height
+    // (0 for RB_PAR_HEIGHT, compiled into rbtree.c).
+    int par_height;
+} rbsetop_t;
+
+void *rb_join(void *L, void *K, void *R, const rbop_t *o);
+void *rb_split(void *N, const void *A, void **L, void **R,
+               const rbop_t *o);
+// s may be NULL (no drop callback, one thread)
+void *rb_union(void *A, void *B, const rbsetop_t *s, const rbop_t *o);
+void *rb_intersect(void *A, void *B, const rbsetop_t *s,
+                   const rbop_t *o);
+void *rb_difference(void *A, void *B, const rbsetop_t *s,
+                    const rbop_t *o);
+
+/* Adds n nodes, sorted in increasing order, to *N.
+ * Equal nodes replace those in the tree (or earlier in the batch),
+ * even with RB_MULTI.  Returns the number of nodes replaced, which
+ * are stored at the start of batch.  Adding m nodes to a tree of
+ * size k takes O(m log(k/m + 1)) comparisons, by building the
+ * batch into a tree and taking the union.
+ */
+size_t add_nodes_sorted(void **N, void **batch, size_t n, const rbop_t *o);
+
+/* Copies every node of N (stride bytes each) into the array at dst,
+ * which must have room for them all, and relinks the copies.
+ * Returns the new root, which is at dst.
+ *
+ * In RB_BFS order each level follows the one above, while RB_VEB
+ * (van Emde Boas) order recursively stores the top half of the
+ * levels before each subtree below them, so any descent stays in
+ * few cache lines and pages whatever their size.
+ *
+ * moved (if not NULL) is called on each node and its copy,
+ * after which the old node is no longer read.  Not for RB_INDEX.
+ */
+#define RB_BFS 0
+#define RB_VEB 1
+void *compact_tree(void *N, void *dst, size_t stride, int order,
+                   void (*moved)(void *from, void *to, void *ctx),
+                   void *ctx, const rbop_t *o);
+
+// returns mask (1 with RB_TAGGED) or 0
 unsigned char get_mask(const void *N, const rbop_t *o);
+/* <0, 0, >0 as key K sorts before, with, or after node N.
+ * get_key returns the key of node N in the form compare_key takes.
+ */
+int compare_key(const void *K, const void *N, const rbop_t *o);
+const void *get_key(const void *N, const rbop_t *o);
+// the left (dir < 0) or right child of N, in any link layout
+void *child_node(void *N, int dir, const rbop_t *o);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
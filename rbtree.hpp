@@ -0,0 +1,260 @@
+/*    Copyright (C) David M. Rogers, 2014
+ *
+ *    David M. Rogers <predictivestatmech@gmail.com>
+ *    Nonequilibrium Stat. Mech. Research Group
+ *    Department of Chemistry
+ *    University of South Florida
+ *
+ *    This file is part of rbtree.
+ *
+ *    rbtree is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    rbtree is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with rbtree.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _RBTREE_HPP
+#define _RBTREE_HPP
+
+/* Header-only C++ front-end to the same intrusive, parent-pointer-free
+ * red/black tree as rbtree.c.  Where rbop_t carries the node layout
+ * (coff, boff, mask) and comparator at run-time, here they are
+ * template arguments, so every link access is a fixed-offset load
+ * and the comparator is inlined into the descent.
+ *
+ * Compare is a function object returning <0, 0, >0 like rbop_t::cmp,
+ * called as cmp(key, node).  Any key type it accepts can be
+ * used with find() and erase(); insert() calls it as cmp(node, node).
+ *
+ * Example:
+ *   struct ent { int n; unsigned char mark; ent *L, *R; };
+ *   struct ent_cmp {
+ *       int operator()(const ent &a, const ent &b) const
+ *           { return (a.n > b.n) - (a.n < b.n); }
+ *   };
+ *   rb::intrusive_tree<ent, &ent::L, &ent::R, &ent::mark, ent_cmp> t(&nil);
+ */
+namespace rb {
+
+template <class Node, Node *Node::*L, Node *Node::*R,
+          unsigned char Node::*Mark, class Compare,
+          unsigned char Mask = 1>
+class intrusive_tree {
+public:
+    // Longest root-to-leaf path in a red/black tree of < 2^64 nodes.
+    static const int max_depth = 2*64;
+
+    explicit intrusive_tree(Node *nil = 0, Compare cmp = Compare())
+        : root_(nil), nil_(nil), cmp_(cmp) {}
+
+    Node *root() const { return root_; }
+    Node *nil() const { return nil_; }
+    bool empty() const { return root_ == nil_; }
+
+    // Returns the node comparing equal to k, or nil.
+    template <class K>
+    Node *find(const K &k) const {
+        Node *C = root_;
+        while(C != nil_) {
+            int d = cmp_(k, *C);
+            if(d < 0) C = C->*L;
+            else if(d > 0) C = C->*R;
+            else break;
+        }
+        return C;
+    }
+
+    // Returns the node A replaced, or nil.
+    Node *insert(Node *A) {
+        Node *P[max_depth];
+        int D[max_depth]; // D[i] = direction taken from P[i]
+        int n = 0, k, dp;
+        Node *C = root_, *p, *g, *u;
+
+        while(C != nil_) {
+            int d = cmp_(*A, *C);
+            if(d == 0) { // replacement case
+                A->*L = C->*L;
+                A->*R = C->*R;
+                set_color(A, is_red(C));
+                relink(P, D, n, A);
+                return C;
+            }
+            if(n == max_depth) return nil_; // not a red-black tree
+            P[n] = C;
+            D[n++] = d < 0 ? -1 : 1;
+            C = d < 0 ? C->*L : C->*R;
+        }
+        A->*L = nil_;
+        A->*R = nil_;
+        if(n == 0) {
+            color_black(A);
+            root_ = A;
+            return nil_;
+        }
+        color_red(A);
+        child(P[n-1], D[n-1]) = A;
+
+        // A (red) sits at depth k, below P[k-1]
+        for(C = A, k = n; k > 0 && is_red(P[k-1]); ) {
+            p = P[k-1]; // red, so not the root
+            g = P[k-2];
+            dp = D[k-2];
+            u = child(g, -dp);
+            if(is_red(u)) { // push blackness down from g
+                color_black(p);
+                color_black(u);
+                color_red(g);
+                C = g;
+                k -= 2;
+                continue;
+            }
+            if(D[k-1] != dp) { // inward-leaning, rotate C above p
+                child(p, -dp) = child(C, dp);
+                child(C, dp) = p;
+                child(g, dp) = C;
+                p = C;
+            }
+            // outward-leaning, rotate p above g
+            child(g, dp) = child(p, -dp);
+            child(p, -dp) = g;
+            color_black(p);
+            color_red(g);
+            relink(P, D, k-2, p);
+            break;
+        }
+        color_black(root_);
+        return nil_;
+    }
+
+    // Returns the unlinked node comparing equal to k, or nil.
+    template <class K>
+    Node *erase(const K &k) {
+        Node *P[max_depth+1];
+        int D[max_depth+1];
+        int n = 0, j, dx, red;
+        Node *Z = root_, *Y, *C, *p, *s, *sn, *sf;
+
+        while(Z != nil_) {
+            int d = cmp_(k, *Z);
+            if(d == 0) break;
+            if(n == max_depth) return nil_;
+            P[n] = Z;
+            D[n++] = d < 0 ? -1 : 1;
+            Z = d < 0 ? Z->*L : Z->*R;
+        }
+        if(Z == nil_) return nil_;
+
+        if(Z->*L == nil_ || Z->*R == nil_) {
+            C = Z->*L == nil_ ? Z->*R : Z->*L;
+            red = is_red(Z);
+            relink(P, D, n, C);
+            j = n;
+        } else { // swap in the nearest leaf on the far side from P
+            int ds = (n == 0 || D[n-1] < 0) ? 1 : -1;
+            P[n] = Z;
+            D[n] = ds;
+            j = n+1;
+            for(Y = child(Z, ds); child(Y, -ds) != nil_; Y = child(Y, -ds)) {
+                if(j == max_depth) return nil_;
+                P[j] = Y;
+                D[j++] = -ds;
+            }
+            C = child(Y, ds);
+            red = is_red(Y);
+            child(P[j-1], D[j-1]) = C; // unlink Y
+            Y->*L = Z->*L;
+            Y->*R = Z->*R;
+            set_color(Y, is_red(Z));
+            relink(P, D, n, Y);
+            P[n] = Y;
+        }
+        if(red) return Z;
+        if(is_red(C)) {
+            color_black(C);
+            return Z;
+        }
+
+        // the subtree at depth j (below P[j-1]) is one black short
+        while(j > 0) {
+            p = P[j-1];
+            dx = D[j-1];
+            s = child(p, -dx);
+            if(is_red(s)) { // rotate s above p, then re-try with black s
+                child(p, -dx) = child(s, dx);
+                child(s, dx) = p;
+                relink(P, D, j-1, s);
+                color_black(s);
+                color_red(p);
+                P[j-1] = s;
+                D[j-1] = dx;
+                P[j] = p;
+                D[j++] = dx;
+                s = child(p, -dx);
+            }
+            sn = child(s, dx);
+            sf = child(s, -dx);
+            if(!is_red(sf)) {
+                if(!is_red(sn)) {
+                    color_red(s);
+                    if(is_red(p)) {
+                        color_black(p);
+                        break;
+                    }
+                    j--;
+                    continue;
+                }
+                child(s, dx) = child(sn, -dx);
+                child(sn, -dx) = s;
+                child(p, -dx) = sn;
+                color_black(sn);
+                color_red(s);
+                sf = s;
+                s = sn;
+            }
+            child(p, -dx) = child(s, dx);
+            child(s, dx) = p;
+            relink(P, D, j-1, s);
+            set_color(s, is_red(p));
+            color_black(p);
+            color_black(sf);
+            break;
+        }
+        return Z;
+    }
+
+private:
+    Node *root_, *nil_;
+    Compare cmp_;
+
+    static Node *&child(Node *N, int d) {
+        return d < 0 ? N->*L : N->*R;
+    }
+    bool is_red(const Node *N) const {
+        return N != nil_ && (N->*Mark & Mask);
+    }
+    static void color_red(Node *N) { N->*Mark |= Mask; }
+    static void color_black(Node *N) {
+        N->*Mark &= (unsigned char)~Mask;
+    }
+    static void set_color(Node *N, bool red) {
+        if(red) color_red(N);
+        else color_black(N);
+    }
+    // Point the link into depth n of the path at x.
+    void relink(Node **P, const int *D, int n, Node *x) {
+        if(n == 0) root_ = x;
+        else child(P[n-1], D[n-1]) = x;
+    }
+};
+
+} // namespace rb
+
+#endif
@@ -1,13 +1,23 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <pthread.h>
 #include "rbtree.h"
+#include "rbmap.h"
+#include "rbepoch.h"
+#include "rbpool.h"
+#include "rbfreeze.h"
+#include "rbfile.h"
+#include "rbpq.h"
 
 struct dirent;
 struct dirent {
     int n;
     unsigned char mark;
     struct dirent *L, *R;
+    size_t size;
 } dex; // member for addressing purposes only
 
 // could also have used NULL
@@ -25,6 +35,22 @@ static rbop_t rbinf = {
     .boff = (void *)&(dex.mark) - (void *)&dex,
     .nil = &nil,
     .mask = 1, // use smallest bit
+    .soff = (void *)&(dex.size) - (void *)&dex,
+    .koff = (void *)&(dex.n) - (void *)&dex,
+};
+
+// Optional features to run the whole test under.
+static const struct {
+    const char *name;
+    unsigned int flags;
+    int ktype;
+} modes[] = {
+    {"plain", 0},
+    {"counted", RB_COUNT},
+    {"indexed", RB_INDEX | RB_COUNT},
+    {"tagged", RB_TAGGED},
+    {"tagged index", RB_TAGGED | RB_INDEX},
+    {"keyed", RB_COUNT, RB_KEY_INT32}, // keys are the bare ints
 };
 
 //static int N = 16;
@@ -32,20 +58,36 @@ static int N = 1 << (4*3); // (~ 4k)
 //static int N = 1 << (4*3+10); // (~ 4k)*1024
 
 static void dot_rec(FILE *f, struct dirent *a, int n);
+static int check_tree(struct dirent *a);
+static int test_iter(void *tree);
+static int test_bounds(void *tree);
+static int test_order(void *tree);
+static int test_freeze(void *tree);
+static int test_lookups(void *tree);
+static int test_stats(int n);
+static int test_file(void *tree, int n);
+static int test_build(struct dirent *ent);
+static int test_setops(struct dirent *ent);
+static int test_ival(void);
+static int test_map(struct dirent *ent);
+static int test_persist(void);
+static int test_pool(void);
+static int test_multi(struct dirent *ent);
+static int test_find_or_add(void **tree, struct dirent *ent);
+static int test_hints(struct dirent *ent);
+static int test_pq(struct dirent *ent);
+static int test_overflow(struct dirent *ent);
 void tree_to_dot(FILE *f, struct dirent *a);
 int show_tree(char *name, struct dirent *a, int waitfor);
 
+static int run_tests(struct dirent *ent);
+
 int main(int argc, char **argv) {
-    int i, j, k;
-    int ord[N];
-    char buf[32];
-    struct dirent *ent, *ret;
-    //struct dirent *tree = NULL;
-    void *tree = rbinf.nil; // actually struct dirent *
-    // will segfault is tree is NULL (unless rbinf.nil == NULL)
-    size_t len;
-    
-    if( (ent = malloc(N*sizeof(struct dirent))) == NULL) {
+    struct dirent *ent;
+    int i;
+
+    // ent, then test_setops' second set and duplicate: one arena for RB_INDEX
+    if( (ent = malloc((2*N+1)*sizeof(struct dirent))) == NULL) {
         perror("malloc");
         return 2;
     }
@@ -54,11 +96,38 @@ int main(int argc, char **argv) {
         srand(i);
         printf("Seeded rand with %d\n", i);
     }
+    for(i=0; i<sizeof(modes)/sizeof(modes[0]); i++) {
+        printf("Running %s tests.\n", modes[i].name);
+        rbinf.flags = modes[i].flags;
+        rbinf.ktype = modes[i].ktype;
+        rbinf.cmp = modes[i].ktype ? NULL : int_cmp; // must go unused
+        rbinf.base = ent;
+        rbinf.stride = sizeof(struct dirent);
+        if(run_tests(ent)) {
+            printf("an error occured.\n");
+            free(ent);
+            return 1;
+        }
+    }
+    free(ent);
+    return 0;
+}
+
+static int run_tests(struct dirent *ent) {
+    int i, j, k;
+    int ord[N];
+    struct dirent *ret;
+    //struct dirent *tree = NULL;
+    void *tree = rbinf.nil; // actually struct dirent *
+    // will segfault is tree is NULL (unless rbinf.nil == NULL)
+
     for(i=0; i<N; i++) {
         ent[i].n = i;
+        ent[i].mark = 0;
         ord[i] = i;
     }
     printf("Testing %d additions.\n", N);
+    get_stats(NULL, 1);
     for(j=0; j<N; j++) {
         k = random() % (N-j) + j; // randomize ord in-place
         i = ord[k];
@@ -66,13 +135,26 @@ int main(int argc, char **argv) {
         ord[j] = i;
         //printf("Adding %d.\n", i);
         if(add_node(&tree, ent+i, &rbinf) != rbinf.nil) goto err;
+        if(j % 256 == 0 && check_tree(tree) < 0) goto err;
         /*if(j < 10) {
             show_tree("test.dot", tree, 1);
         }*/
     }
+    if(test_stats(N)) goto err;
+    if(check_tree(tree) < 0) goto err;
     printf("Finished addition phase.\n");
+
+    printf("Testing traversal.\n");
+    if(test_iter(tree)) goto err;
+    if(test_bounds(tree)) goto err;
+    if(test_order(tree)) goto err;
+    if(test_freeze(tree) || test_lookups(tree)) goto err;
+    if(test_file(tree, N)) goto err;
     //show_tree("test.dot", tree, 0);
 
+    printf("Testing find-or-add.\n");
+    if(test_find_or_add(&tree, ent)) goto err;
+
     printf("Testing false del.\n");
     i = -1; // non-existent node
     if( (ret = del_node(&tree, (void *)&i, &rbinf)) != rbinf.nil) {
@@ -90,6 +172,14 @@ int main(int argc, char **argv) {
         //fgets(buf, sizeof(buf), stdin);
         if( (ret = del_node(&tree, (void *)&i, &rbinf)) == rbinf.nil)
             goto err;
+        if(j % 256 == 0 && check_tree(tree) < 0) goto err;
+        if(j == N/2 + 3 && (test_freeze(tree) || test_lookups(tree)))
+            goto err;
+        // i is gone, so its neighbors bracket it
+        if(((struct dirent *)floor_node(tree, &i, &rbinf))->n >= i
+                || ((ret = ceil_node(tree, &i, &rbinf)) != &nil
+                    && ret->n <= i))
+            goto err;
         //printf("Got: %d\n", ret->n);
         /*if(N-j < 10) {
             show_tree("test.dot", tree, 1);
@@ -103,16 +193,1094 @@ int main(int argc, char **argv) {
         goto err;
     }
 
-    free(ent);
+    if(test_freeze(tree) || test_file(tree, 0)) goto err;
+
+    printf("Testing cursor adds and dels.\n");
+    if(test_hints(ent)) goto err;
+
+    printf("Testing priority queue.\n");
+    if(test_pq(ent)) goto err;
+
+    if(rbinf.flags == 0 && rbinf.ktype == 0) { // links are plain fields
+        printf("Testing corrupt (too deep) trees.\n");
+        if(test_overflow(ent)) goto err;
+    }
+
+    printf("Testing sorted build.\n");
+    if(test_build(ent)) goto err;
+
+    printf("Testing join, split and set operations.\n");
+    if(test_setops(ent)) goto err;
+
+    printf("Testing interval trees.\n");
+    if(test_ival()) goto err;
+
+    printf("Testing sharded map.\n");
+    if(test_map(ent)) goto err;
+
+    if(!(rbinf.flags & RB_INDEX)) { // nodes come from malloc
+        printf("Testing persistent snapshots.\n");
+        if(test_persist()) goto err;
+        printf("Testing node pool and compaction.\n");
+        if(test_pool()) goto err;
+    }
+
+    printf("Testing duplicate keys.\n");
+    if(test_multi(ent)) goto err;
     return 0;
 
 err:
-    printf("an error occured.\n");
-    free(ent);
     return 1;
 }
 
+// ctx holds the next expected key
+static int range_cb(void *node, void *ctx) {
+    struct dirent *a = node;
+    int *i = ctx;
+    if(a->n != (*i)++) {
+        printf("Range visited %d, expected %d.\n", a->n, *i-1);
+        return -1;
+    }
+    return 0;
+}
+
+static int range_count(void *tree, int *lo, int *hi) {
+    int start = (lo == NULL || *lo < 0) ? 0 : *lo;
+    int i = start;
+    if(foreach_range(tree, lo, hi, range_cb, &i, &rbinf))
+        return -1;
+    return i - start;
+}
+
+// Assumes tree holds 0, 1, ..., N-1.
+static int test_iter(void *tree) {
+    rbpath_t it;
+    struct dirent *a;
+    int i, lo, hi;
+
+    for(i = 0, a = first_node(&it, tree, &rbinf); a != &nil;
+                a = next_node(&it, &rbinf), i++) {
+        if(a->n != i) {
+            printf("Forward traversal found %d, expected %d.\n", a->n, i);
+            return 1;
+        }
+    }
+    if(i != N) return 1;
+    for(i = N-1, a = last_node(&it, tree, &rbinf); a != &nil;
+                a = prev_node(&it, &rbinf), i--) {
+        if(a->n != i) {
+            printf("Reverse traversal found %d, expected %d.\n", a->n, i);
+            return 1;
+        }
+    }
+    if(i != -1) return 1;
+
+    lo = N/4; hi = N/2;
+    if(range_count(tree, &lo, &hi) != hi-lo+1) return 1;
+    lo = N-5; hi = N+5;
+    if(range_count(tree, &lo, &hi) != 5) return 1;
+    lo = -5;
+    if(range_count(tree, &lo, NULL) != N) return 1;
+    if(range_count(tree, NULL, NULL) != N) return 1;
+    lo = N; hi = N+5;
+    if(range_count(tree, &lo, &hi) != 0) return 1;
+    return 0;
+}
+
+static int expect(const char *what, int key, struct dirent *a, int n) {
+    if(a->n != n) {
+        printf("%s(%d) returned %d, expected %d.\n", what, key, a->n, n);
+        return 1;
+    }
+    return 0;
+}
+
+// Assumes tree holds 0, 1, ..., N-1.
+static int test_bounds(void *tree) {
+    int i;
+
+    i = N/3;
+    if(expect("floor_node", i, floor_node(tree, &i, &rbinf), i)
+        || expect("ceil_node", i, ceil_node(tree, &i, &rbinf), i)
+        || expect("lower_bound", i, lower_bound(tree, &i, &rbinf), i)
+        || expect("upper_bound", i, upper_bound(tree, &i, &rbinf), i+1))
+        return 1;
+    i = -3;
+    if(expect("floor_node", i, floor_node(tree, &i, &rbinf), nil.n)
+        || expect("ceil_node", i, ceil_node(tree, &i, &rbinf), 0))
+        return 1;
+    i = N+3;
+    if(expect("floor_node", i, floor_node(tree, &i, &rbinf), N-1)
+        || expect("ceil_node", i, ceil_node(tree, &i, &rbinf), nil.n))
+        return 1;
+    i = N-1;
+    if(expect("upper_bound", i, upper_bound(tree, &i, &rbinf), nil.n))
+        return 1;
+    return 0;
+}
+
+// Assumes tree holds 0, 1, ..., N-1.
+static int test_order(void *tree) {
+    int i, lo, hi;
+
+    if(!(rbinf.flags & RB_COUNT)) return 0;
+    for(i = 0; i < N; i += 7) {
+        if(expect("select_node", i, select_node(tree, i, &rbinf), i))
+            return 1;
+        if(rank_node(tree, &i, &rbinf) != i) {
+            printf("rank_node(%d) is wrong.\n", i);
+            return 1;
+        }
+    }
+    if(expect("select_node", N, select_node(tree, N, &rbinf), nil.n))
+        return 1;
+    lo = N/4; hi = N/2;
+    if(count_range(tree, &lo, &hi, &rbinf) != hi-lo+1
+            || count_range(tree, NULL, &hi, &rbinf) != hi+1
+            || count_range(tree, &lo, NULL, &rbinf) != N-lo
+            || count_range(tree, &hi, &lo, &rbinf) != 0) {
+        printf("count_range is wrong.\n");
+        return 1;
+    }
+    return 0;
+}
+
+// Batched lookups of -1, ..., N must match lookup_node.
+static int test_lookups(void *tree) {
+    const void **keys = malloc((N+2)*sizeof(void *));
+    void **out = malloc((N+2)*sizeof(void *));
+    int *k = malloc((N+2)*sizeof(int));
+    int i, ret = 1;
+
+    if(keys == NULL || out == NULL || k == NULL) goto out;
+    for(i=0; i<N+2; i++) {
+        k[i] = i-1;
+        keys[i] = k+i;
+    }
+    lookup_nodes(tree, keys, out, N+2, &rbinf);
+    for(i=0; i<N+2; i++)
+        if(out[i] != lookup_node(tree, k+i, &rbinf)) {
+            printf("lookup_nodes disagrees at %d.\n", k[i]);
+            goto out;
+        }
+    ret = 0;
+out:
+    free(k);
+    free(out);
+    free(keys);
+    return ret;
+}
+
+// After n fresh adds.  Without RB_STATS, everything stays zero.
+static int test_stats(int n) {
+    rbstats_t s;
+    unsigned long rot;
+
+    get_stats(&s, 1);
+#ifdef RB_STATS
+    unsigned long h = 0;
+
+    while((1ul << h) <= (unsigned long)n) h++;
+    rot = s.add_case[2] + s.add_case[3];
+    if(s.descents != (unsigned long)n || s.replaced != 0
+            || s.depth < (unsigned long)n || s.max_depth > 2*h
+            || s.cmp < s.depth || s.rot != rot || s.add_case[3] == 0) {
+        printf("Unexpected stats: %lu descents, depth %lu (max %lu), "
+               "%lu cmp, %lu rot.\n", s.descents, s.depth, s.max_depth,
+               s.cmp, s.rot);
+        return 1;
+    }
+#else
+    rot = s.cmp | s.rot | s.recolor | s.descents | s.depth | s.replaced;
+    if(rot != 0) {
+        printf("Stats counted without RB_STATS.\n");
+        return 1;
+    }
+#endif
+    get_stats(&s, 0);
+    return s.cmp != 0;
+}
+
+// Save tree (holding keys 0 .. n-1), then search the mapped file.
+static int test_file(void *tree, int n) {
+    const char *path = "test.rbt";
+    rbpath_t it;
+    rbfile_t f, f2;
+    struct dirent *C;
+    int i, ret = 1;
+
+    if(save_tree(path, tree, sizeof(struct dirent), &rbinf)
+            || map_tree(&f, path, sizeof(struct dirent), &rbinf)) {
+        perror(path);
+        unlink(path);
+        return 1;
+    }
+    if(f.n != n) goto out;
+    errno = 0;
+    if(save_tree(path, tree, 0, &rbinf) == 0 || errno != EINVAL
+            || map_tree(&f2, path, rbinf.coff, &rbinf) == 0
+            || errno != EINVAL) {
+        printf("Saved or mapped a tree with too small a node size.\n");
+        goto out;
+    }
+    for(i=-1; i<=n; i++) {
+        C = lookup_node(f.root, &i, &f.op);
+        if((i < 0 || i == n) != (C == &nil)) goto out;
+        if(C != &nil && (C->n != i || (void *)C < f.map
+                                   || (void *)C >= f.map + f.len))
+            goto out;
+    }
+    i = 0;
+    for(C = first_node(&it, f.root, &f.op); C != &nil;
+                C = next_node(&it, &f.op), i++) {
+        if(C->n != i) goto out;
+        if((rbinf.flags & RB_COUNT) && select_node(f.root, i, &f.op) != C)
+            goto out;
+    }
+    ret = i != n;
+out:
+    if(ret) printf("Mapped tree differs.\n");
+    unmap_tree(&f);
+    unlink(path);
+    return ret;
+}
+
+static long long dirent_key(const void *node) {
+    return ((const struct dirent *)node)->n;
+}
+
+// The frozen copy must answer just like the tree.
+static int test_freeze(void *tree) {
+    rbfrozen_t f;
+    int i, ret = 0;
+
+    if(freeze_tree(&f, tree, dirent_key, &rbinf)) return 1;
+    for(i=-1; i<=N; i++) {
+        if(frozen_lookup(&f, i) != lookup_node(tree, &i, &rbinf)
+                || frozen_lower_bound(&f, i) != lower_bound(tree, &i, &rbinf)) {
+            printf("Frozen tree disagrees at %d.\n", i);
+            ret = 1;
+            break;
+        }
+    }
+    free_frozen(&f);
+    return ret;
+}
+
+// Marks nodes visited with the second bit, checking children went first.
+static void clear_cb(void *node, void *ctx) {
+    struct dirent *a = node;
+    struct dirent *l = child_node(a, -1, &rbinf), *r = child_node(a, 1, &rbinf);
+    int *count = ctx;
+
+    if((l != &nil && !(l->mark & 2)) || (r != &nil && !(r->mark & 2))) {
+        printf("Node %d cleared before its children.\n", a->n);
+        *count = -N;
+    }
+    a->mark |= 2;
+    (*count)++;
+}
+
+static int test_build(struct dirent *ent) {
+    void **nodes = malloc(N*sizeof(void *));
+    void *tree;
+    int i, ret = 1;
+
+    if(nodes == NULL) return 1;
+    for(i=0; i<N; i++)
+        nodes[i] = ent+i;
+    for(i=0; i<=64; i++) { // every shape of bottom level
+        if(check_tree(build_tree_sorted(nodes, i, &rbinf)) < 0) {
+            printf("Bad tree built from %d nodes.\n", i);
+            goto out;
+        }
+    }
+    tree = build_tree_sorted(nodes, N, &rbinf);
+    if(check_tree(tree) < 0 || test_iter(tree))
+        goto out;
+    i = N/2; // still usable as a normal tree
+    if(del_node(&tree, &i, &rbinf) != ent+i
+            || add_node(&tree, ent+i, &rbinf) != &nil
+            || check_tree(tree) < 0)
+        goto out;
+
+    printf("Testing clear.\n");
+    i = 0;
+    clear_tree(&tree, clear_cb, &i, &rbinf);
+    if(i != N || tree != &nil) {
+        printf("Cleared %d of %d nodes.\n", i, N);
+        goto out;
+    }
+    ret = 0;
+out:
+    free(nodes);
+    return ret;
+}
+
+static void merge_cb(void *E, void *A, void *ctx) {
+    struct dirent **seen = ctx;
+    seen[0] = E;
+    seen[1] = A;
+}
+
+// On the full tree, with ent[2N] free to use as a duplicate.
+static int test_find_or_add(void **tree, struct dirent *ent) {
+    struct dirent *dup = ent + 2*N, *seen[2] = {NULL, NULL};
+    int i;
+
+    for(i=0; i<N; i+=37) {
+        dup->n = i;
+        if(find_or_add_node(tree, dup, &rbinf) != ent+i
+                || upsert_node(tree, dup, merge_cb, seen, &rbinf) != ent+i
+                || seen[0] != ent+i || seen[1] != dup)
+            return 1;
+        if(del_node(tree, &i, &rbinf) != ent+i
+                || upsert_node(tree, ent+i, merge_cb, NULL, &rbinf) != ent+i
+                || lookup_node(*tree, &i, &rbinf) != ent+i)
+            return 1;
+    }
+    return check_tree(*tree) < 0;
+}
+
+// Cursor on the node with key k (from 0 .. N-1 with none missing).
+static void *seek_rank(rbpath_t *it, void *tree, int k) {
+    void *C = first_node(it, tree, &rbinf);
+
+    while(k-- > 0)
+        C = next_node(it, &rbinf);
+    return C;
+}
+
+/* Append the even keys, add every 64th odd key after its cursor,
+ * and the rest with a bad hint (so through add_node).
+ * Then expire from both ends and the middle at cursors.
+ */
+static int test_hints(struct dirent *ent) {
+    void *tree = &nil;
+    struct dirent *C;
+    rbpath_t it;
+    int i, k;
+
+    for(i=0; i<N; i+=2)
+        if(add_node_last(&tree, ent+i, &rbinf) != &nil) return 1;
+    if(check_tree(tree) < 0) return 1;
+    for(i=1; i<N; i+=2) {
+        if(i % 64 == 1) seek_rank(&it, tree, i-1);
+        else first_node(&it, tree, &rbinf);
+        if(add_node_after(&tree, &it, ent+i, &rbinf) != &nil
+                || it.n != -1)
+            return 1;
+    }
+    if(check_tree(tree) < 0 || test_iter(tree)) return 1;
+
+    k = N/2;
+    if(del_node_at(&tree, &it, &rbinf) != &nil // spent cursor
+            || seek_rank(&it, tree, k) != ent+k
+            || del_node_at(&tree, &it, &rbinf) != ent+k)
+        return 1;
+    for(i=1; i<N; i++) {
+        C = i % 2 ? last_node(&it, tree, &rbinf)
+                  : first_node(&it, tree, &rbinf);
+        if(C == ent+k || del_node_at(&tree, &it, &rbinf) != C)
+            return 1;
+        if(i % 256 == 0 && check_tree(tree) < 0) return 1;
+    }
+    return tree != &nil;
+}
+
+static int check_ends(rbpq_t *q) {
+    rbpath_t it;
+
+    if(peek_min(q) != first_node(&it, q->root, &rbinf)
+            || peek_max(q) != last_node(&it, q->root, &rbinf)) {
+        printf("Stale priority queue ends.\n");
+        return 1;
+    }
+    return 0;
+}
+
+/* Add in random order, take a few off each end by key and by node,
+ * then pop from alternating ends until empty.
+ */
+static int test_pq(struct dirent *ent) {
+    struct dirent *C;
+    rbpq_t q;
+    int i, k, lo = 0, hi = N-1;
+
+    pq_init(&q, &rbinf);
+    if(pop_min(&q, &rbinf) != &nil || check_ends(&q)) return 1;
+    for(i=0; i<N; i++) { // some twice
+        pq_add(&q, ent + random() % N, &rbinf);
+        if(i % 16 == 0 && check_ends(&q)) return 1;
+    }
+    for(i=0; i<N; i++)
+        pq_add(&q, ent+i, &rbinf);
+    if(check_tree(q.root) < 0 || check_ends(&q)) return 1;
+    // the min by key and the max by node, then the max again once re-added
+    if(pq_del(&q, &lo, &rbinf) != ent+lo
+            || pq_remove(&q, ent+hi, &rbinf) != ent+hi)
+        return 1;
+    k = hi;
+    if(pq_add(&q, ent+k, &rbinf) != &nil || check_ends(&q)
+            || pq_del(&q, &k, &rbinf) != ent+k)
+        return 1;
+    lo++;
+    hi--;
+    for(i=0; lo <= hi; i++) {
+        C = i % 3 ? pop_min(&q, &rbinf) : pop_max(&q, &rbinf);
+        if(C != ent + (i % 3 ? lo++ : hi--)) return 1;
+        if((i % 64 == 0 || lo > hi - 3) && check_ends(&q)) return 1;
+    }
+    return q.root != &nil || pop_max(&q, &rbinf) != &nil;
+}
+
+/* 0 <- 1 -> 300 -> ... -> 2, all black and all on left links
+ * below 300, so 1's successor is far below RB_MAX_DEPTH.
+ * Adds and dels must leave it unchanged and say so.
+ */
+static int test_overflow(struct dirent *ent) {
+    void *tree = ent+1;
+    int i;
+
+    for(i=0; i<=300; i++) {
+        ent[i].n = i;
+        ent[i].mark = 0;
+        ent[i].L = ent[i].R = &nil;
+    }
+    ent[1].L = ent;
+    ent[1].R = ent+300;
+    for(i=300; i>2; i--)
+        ent[i].L = ent+i-1;
+    ent[301].n = 150; // lands below the chain
+    ent[301].mark = 0;
+    i = 2;
+    if(add_node(&tree, ent+301, &rbinf) != ent+301
+            || del_node(&tree, &i, &rbinf) != &nil) // too deep to find
+        return 1;
+    ent[301].n = 301;
+    i = 1;
+    if(del_node(&tree, &i, &rbinf) != &nil // too deep to unlink
+            || remove_node(&tree, ent+1, &rbinf) != &nil
+            || tree != ent+1 || ent[1].L != ent || ent[1].R != ent+300
+            || ent[3].L != ent+2 || ent[150].L != ent+149)
+        return 1;
+    return 0;
+}
+
+static int count_cb(void *node, void *ctx) {
+    (*(int *)ctx)++;
+    return 0;
+}
+
+#define DUPS 8 // copies of each key
+
+/* Key k is held by ent[k + j*m] for j < DUPS.  These are added
+ * in index order, so equal keys should come out in that order.
+ */
+static int test_multi(struct dirent *ent) {
+    void *tree = &nil;
+    struct dirent *C;
+    rbpath_t it;
+    int i, k, n, m = N/DUPS, ret = 1;
+
+    rbinf.flags |= RB_MULTI;
+    for(i=0; i<N; i++) {
+        ent[i].n = i % m;
+        ent[i].mark = 0;
+    }
+    for(i=0; i<N; i++)
+        if(add_node(&tree, ent+i, &rbinf) != &nil) goto out;
+    if(check_tree(tree) < 0) goto out;
+    i = 0;
+    for(C = first_node(&it, tree, &rbinf); C != &nil;
+                C = next_node(&it, &rbinf), i++)
+        if(C != ent + i/DUPS + i%DUPS*m) {
+            printf("Duplicate %d out of order.\n", C->n);
+            goto out;
+        }
+    if(i != N) goto out;
+
+    for(k=0; k<m; k+=7) {
+        n = 0;
+        foreach_range(tree, &k, &k, count_cb, &n, &rbinf);
+        C = upper_bound(tree, &k, &rbinf);
+        if(lower_bound(tree, &k, &rbinf) != ent+k || n != DUPS
+                || floor_node(tree, &k, &rbinf) != ent+k + (DUPS-1)*m
+                || C != (k+1 < m ? ent+k+1 : &nil)) {
+            printf("Wrong equal range for %d.\n", k);
+            goto out;
+        }
+        if((rbinf.flags & RB_COUNT)
+                && (count_range(tree, &k, &k, &rbinf) != DUPS
+                    || rank_node(tree, &k, &rbinf) != k*DUPS))
+            goto out;
+    }
+
+    k = m/2; // a middle copy by identity, then the first by key
+    if(remove_node(&tree, ent+k + 3*m, &rbinf) != ent+k + 3*m
+            || remove_node(&tree, ent+k + 3*m, &rbinf) != &nil
+            || del_node(&tree, &k, &rbinf) != ent+k
+            || lower_bound(tree, &k, &rbinf) != ent+k + m
+            || check_tree(tree) < 0)
+        goto out;
+    for(i=N; i-- > 0; ) {
+        if(i == k || i == k + 3*m) continue;
+        if(remove_node(&tree, ent+i, &rbinf) != ent+i) goto out;
+        if(i % 256 == 0 && check_tree(tree) < 0) goto out;
+    }
+    ret = tree != &nil;
+out:
+    rbinf.flags &= ~RB_MULTI;
+    return ret;
+}
+
+static void drop_cb(void *node, void *ctx) {
+    __atomic_add_fetch((int *)ctx, 1, __ATOMIC_RELAXED);
+}
+
+// Build a tree from the nodes whose keys are multiples of k.
+static void *build_mult(struct dirent *ent, int k, int *n) {
+    void **nodes = malloc(N*sizeof(void *));
+    void *tree;
+    int i;
+
+    for(i=*n=0; i<N; i+=k)
+        nodes[(*n)++] = ent+i;
+    tree = build_tree_sorted(nodes, *n, &rbinf);
+    free(nodes);
+    return tree;
+}
+
+/* Checks that T holds keys i with (i%2 == 0, i%3 == 0) selected
+ * by keep[i%2 == 0][i%3 == 0], taken from b when i%3 == 0.
+ */
+static int check_set(void *T, int keep[2][2], struct dirent *a,
+                     struct dirent *b, int *count) {
+    rbpath_t it;
+    struct dirent *x;
+    int i = 0;
+
+    if(check_tree(T) < 0) return 1;
+    for(x = first_node(&it, T, &rbinf); x != &nil; x = next_node(&it, &rbinf)) {
+        for(; i < x->n; i++) {
+            if(keep[i%2 == 0][i%3 == 0]) {
+                printf("Set operation lost %d.\n", i);
+                return 1;
+            }
+        }
+        if(!keep[i%2 == 0][i%3 == 0] || x != (i%3 == 0 ? b : a)+i) {
+            printf("Set operation wrongly kept %d.\n", i);
+            return 1;
+        }
+        (*count)++;
+        i++;
+    }
+    return 0;
+}
+
+static int test_setops(struct dirent *ent) {
+    struct dirent *ent2 = ent+N, *dup = ent+2*N;
+    void **nodes = malloc(N*sizeof(void *));
+    int keep[3][2][2] = { // [op][even][multiple of 3]
+        {{0, 1}, {1, 1}}, {{0, 0}, {0, 1}}, {{0, 0}, {1, 0}} };
+    rbsetop_t s = { .drop = drop_cb };
+#ifdef RB_STATS
+    rbstats_t st;
+#endif
+    void *A, *B, *L, *R, *T;
+    int i, j, op, na, nb, count, ret = 1;
+    size_t r;
+
+    if(nodes == NULL) goto out;
+    for(i=0; i<N; i++) {
+        ent2[i].n = i;
+        ent2[i].mark = 0;
+    }
+    dup->n = 3;
+    dup->mark = 0;
+
+    A = build_mult(ent, 1, &na);
+    i = N/3;
+    j = i+1;
+    if(rb_split(A, &i, &L, &R, &rbinf) != ent+i
+            || check_tree(L) < 0 || check_tree(R) < 0
+            || range_count(L, NULL, NULL) != i
+            || range_count(R, &j, NULL) != N-j)
+        goto out;
+    A = rb_join(L, ent+i, R, &rbinf);
+    if(check_tree(A) < 0 || test_iter(A)) goto out;
+    i = -1;
+    if(rb_split(A, &i, &L, &R, &rbinf) != &nil || L != &nil
+            || check_tree(R) < 0 || test_iter(R))
+        goto out;
+
+    // batch version of the union (with one extra duplicate)
+    A = build_mult(ent, 2, &na);
+    for(i=nb=0; i<N; i+=3) {
+        if(i == 3) nodes[nb++] = dup;
+        nodes[nb++] = ent2+i;
+    }
+    r = add_nodes_sorted(&A, nodes, nb, &rbinf);
+    for(i=0; i<r; i++) {
+        T = nodes[i];
+        if(T != dup && (((struct dirent *)T)->n % 6 != 0
+                         || T != ent+((struct dirent *)T)->n)) {
+            printf("add_nodes_sorted replaced the wrong node.\n");
+            goto out;
+        }
+    }
+    count = 0;
+    if(r != 1 + (N+5)/6 || check_set(A, keep[0], ent, ent2, &count)
+            || count != na+nb-r) {
+        printf("add_nodes_sorted lost nodes.\n");
+        goto out;
+    }
+
+    // the test trees are too small to fork at RB_PAR_HEIGHT
+    s.par_height = 2;
+    for(s.threads = 1; s.threads <= 4; s.threads += 3) {
+        get_stats(NULL, 1);
+        for(op = 0; op < 3; op++) {
+            A = build_mult(ent, 2, &na);
+            B = build_mult(ent2, 3, &nb);
+            count = 0;
+            s.ctx = &count;
+            if(op == 0) T = rb_union(A, B, &s, &rbinf);
+            if(op == 1) T = rb_intersect(A, B, &s, &rbinf);
+            if(op == 2) T = rb_difference(A, B, &s, &rbinf);
+            if(check_set(T, keep[op], ent, ent2, &count))
+                goto out;
+            if(count != na+nb) {
+                printf("Set operation %d lost track of %d nodes.\n",
+                        op, na+nb-count);
+                goto out;
+            }
+        }
+#ifdef RB_STATS
+        get_stats(&st, 0);
+        if((st.forks > 0) != (s.threads > 1)) {
+            printf("Set operations on %d threads forked %lu times.\n",
+                   s.threads, st.forks);
+            goto out;
+        }
+#endif
+    }
+    ret = 0;
+out:
+    free(nodes);
+    return ret;
+}
+
+struct ival {
+    long long lo, hi, max;
+    int id;
+    unsigned char mark;
+    struct ival *L, *R;
+} iex;
+
+static struct ival inil;
+
+static int ival_cmp(const void *ai, const void *bi) {
+    const struct ival *a = ai;
+    const struct ival *b = bi;
+    if(a->lo != b->lo) return a->lo < b->lo ? -1 : 1;
+    return a->id - b->id;
+}
+
+static rbival_t ivinf = {
+    .op = {
+        .cmp = ival_cmp,
+        .coff = (void *)&(iex.L) - (void *)&iex,
+        .boff = (void *)&(iex.mark) - (void *)&iex,
+        .nil = &inil,
+        .mask = 1,
+        .update = ival_update,
+    },
+    .loff = (void *)&(iex.lo) - (void *)&iex,
+    .hoff = (void *)&(iex.hi) - (void *)&iex,
+    .moff = (void *)&(iex.max) - (void *)&iex,
+};
+
+// Marks each node visited with the second bit, checking order of lo.
+static int overlap_cb(void *node, void *ctx) {
+    struct ival *a = node;
+    long long *last = ctx;
+
+    if(a->lo < *last) {
+        printf("Interval %d out of order.\n", a->id);
+        return -1;
+    }
+    *last = a->lo;
+    a->mark |= 2;
+    return 0;
+}
+
+static void widen_cb(void *E, void *A, void *ctx) {
+    ((struct ival *)E)->hi = ((struct ival *)A)->hi;
+}
+
+static int test_ival(void) {
+    const int n = 1000;
+    struct ival *v = malloc(n*sizeof(struct ival)), probe;
+    void *tree = &inil;
+    long long lo, hi, last;
+    int i, q, ret = 1;
+
+    if(v == NULL) return 1;
+    inil.max = -1;
+    for(i=0; i<n; i++) {
+        v[i].id = i;
+        v[i].mark = 0;
+        v[i].lo = random() % 10000;
+        v[i].hi = v[i].lo + random() % 200;
+        add_node(&tree, v+i, &ivinf.op);
+    }
+    for(i=0; i<n; i+=2) // exercise unlinking too
+        if(del_node(&tree, v+i, &ivinf.op) != v+i) goto out;
+    for(i=1; i<n; i+=4) { // and widening in place, which must re-pull max
+        probe = v[i];
+        probe.hi += 300;
+        if(upsert_node(&tree, &probe, widen_cb, NULL, &ivinf.op) != v+i
+                || v[i].hi != probe.hi)
+            goto out;
+    }
+
+    for(q=0; q<200; q++) {
+        lo = random() % 10200;
+        hi = lo + random() % 300;
+        last = -1;
+        if(ival_overlap(tree, lo, hi, overlap_cb, &last, &ivinf))
+            goto out;
+        for(i=0; i<n; i++) {
+            if(!(v[i].mark & 2) != (i%2 == 0 || v[i].hi < lo || v[i].lo > hi)) {
+                printf("Interval %d [%lld, %lld] wrongly %s for [%lld, %lld].\n",
+                        i, v[i].lo, v[i].hi,
+                        v[i].mark & 2 ? "found" : "missed", lo, hi);
+                goto out;
+            }
+            v[i].mark &= 1;
+        }
+    }
+    // max depends on the tree's shape, and update on the whole rbival_t
+    errno = 0;
+    if(save_tree("test.rbt", tree, sizeof(struct ival), &ivinf.op) == 0
+            || errno != EINVAL || access("test.rbt", F_OK) == 0
+            || access("test.rbt.tmp", F_OK) == 0) {
+        printf("Saved a tree with an update hook.\n");
+        goto out;
+    }
+    ret = 0;
+out:
+    free(v);
+    return ret;
+}
+
+// Checks keys come in increasing order, counting them.
+static int map_range_cb(void *node, void *ctx) {
+    struct dirent *a = node;
+    int *last = ctx; // last[0] = last key, last[1] = count
+
+    if(a->n <= last[0]) {
+        printf("Map range visited %d after %d.\n", a->n, last[0]);
+        return -1;
+    }
+    last[0] = a->n;
+    last[1]++;
+    return 0;
+}
+
+static int map_count(rbmap_t *m, int *lo, int *hi) {
+    int last[2] = {-1, 0};
+
+    if(rbmap_range(m, lo, hi, map_range_cb, last)) return -1;
+    return last[1];
+}
+
+typedef struct {
+    rbmap_t *m;
+    struct dirent *ent;
+    int id, nthread, err;
+} map_worker_t;
+
+// Repeatedly delete and re-add the keys = id mod nthread.
+static void *map_worker(void *arg) {
+    map_worker_t *w = arg;
+    int i, rep;
+
+    for(rep = 0; rep < 4; rep++) {
+        for(i = w->id; i < N; i += w->nthread)
+            if(rbmap_del(w->m, &i) != w->ent+i) w->err = 1;
+        for(i = w->id; i < N; i += w->nthread)
+            if(rbmap_add(w->m, w->ent+i) != &nil) w->err = 1;
+        if(map_count(w->m, NULL, NULL) < 0) w->err = 1;
+        if(w->id == 0) rbmap_rebalance(w->m);
+    }
+    return NULL;
+}
+
+static int test_map(struct dirent *ent) {
+    rbmap_t m;
+    map_worker_t w[4];
+    pthread_t th[4];
+    int i, lo, hi, ret = 1;
+
+    if(rbmap_init(&m, 8, sizeof(struct dirent), &rbinf)) return 1;
+    for(i=0; i<N; i++) // one shard until the first rebalance
+        if(rbmap_add(&m, ent+(i*7 % N)) != &nil) goto out;
+    if(m.nbound != 7) {
+        printf("Map never rebalanced.\n");
+        goto out;
+    }
+    for(i=0; i<m.nshard; i++) {
+        if(check_tree(m.shard[i].root) < 0) goto out;
+        if(m.shard[i].n < N/8 - N/16) {
+            printf("Map shard %d holds only %zu nodes.\n", i, m.shard[i].n);
+            goto out;
+        }
+    }
+    for(i=0; i<N; i++)
+        if(rbmap_lookup(&m, &i) != ent+i) goto out;
+    lo = N/5; hi = N-N/5;
+    if(map_count(&m, &lo, &hi) != hi-lo+1 || map_count(&m, NULL, NULL) != N)
+        goto out;
+
+    for(i=0; i<4; i++) {
+        w[i] = (map_worker_t){ .m = &m, .ent = ent, .id = i, .nthread = 4 };
+        pthread_create(th+i, NULL, map_worker, w+i);
+    }
+    for(i=0; i<4; i++) {
+        pthread_join(th[i], NULL);
+        if(w[i].err) {
+            printf("Map worker %d failed.\n", i);
+            goto out;
+        }
+    }
+    if(map_count(&m, NULL, NULL) != N) goto out;
+    ret = 0;
+out:
+    rbmap_free(&m, NULL, NULL);
+    return ret;
+}
+
+static void *clone_cb(const void *node, void *ctx) {
+    struct dirent *a = malloc(sizeof(struct dirent));
+
+    if(a == NULL) { // nothing sensible to do in a test
+        perror("malloc");
+        exit(2);
+    }
+    *a = *(const struct dirent *)node;
+    return a;
+}
+
+static void retire_cb(void *node, void *ctx) {
+    epoch_retire(ctx, node);
+}
+
+static void free_cb(void *node, void *ctx) {
+    free(node);
+}
+
+static struct dirent *new_ent(int i) {
+    struct dirent *a = clone_cb(&nil, NULL);
+    a->n = i;
+    return a;
+}
+
+typedef struct {
+    rbepoch_t *e;
+    void **root;
+    int stop, err;
+} reader_t;
+
+// Every snapshot must be a valid tree holding all the odd keys.
+static void *persist_reader(void *arg) {
+    reader_t *r = arg;
+    int slot = epoch_register(r->e), i;
+    void *T;
+
+    if(slot < 0) {
+        r->err = 1;
+        return NULL;
+    }
+    while(!__atomic_load_n(&r->stop, __ATOMIC_ACQUIRE)) {
+        epoch_enter(r->e, slot);
+        T = epoch_root(r->root);
+        if(check_tree(T) < 0) r->err = 1;
+        for(i=1; i<N; i+=2)
+            if(((struct dirent *)lookup_node(T, &i, &rbinf))->n != i)
+                r->err = 1;
+        epoch_exit(r->e, slot);
+    }
+    return NULL;
+}
+
+static int test_persist(void) {
+    rbepoch_t e;
+    rbcow_t c = { .clone = clone_cb, .retire = retire_cb, .ctx = &e };
+    reader_t r;
+    pthread_t th[3];
+    void *root = &nil, *snap, *R;
+    struct dirent *a, *b;
+    int i, j, slot, ret = 1;
+
+    epoch_init(&e, free_cb, NULL);
+    for(i=0; i<N; i++) {
+        j = i*7 % N;
+        epoch_publish(&root, padd_node(root, new_ent(j), &R, &c, &rbinf));
+        epoch_collect(&e);
+    }
+    if(check_tree(root) < 0) goto out;
+
+    // hold a snapshot while deleting the evens and replacing the odds
+    slot = epoch_register(&e);
+    epoch_enter(&e, slot);
+    snap = epoch_root(&root);
+    for(i=0; i<N; i++) {
+        if(i % 2 == 0)
+            epoch_publish(&root, pdel_node(root, &i, &R, &c, &rbinf));
+        else
+            epoch_publish(&root, padd_node(root, new_ent(i), &R, &c, &rbinf));
+        epoch_collect(&e);
+        if(R == &nil || ((struct dirent *)R)->n != i) {
+            printf("Persistent op on %d returned the wrong node.\n", i);
+            goto out;
+        }
+    }
+    if(check_tree(snap) < 0 || range_count(snap, NULL, NULL) != N
+                            || check_tree(root) < 0)
+        goto out;
+    for(i=0; i<N; i++) { // the odds were replaced by new nodes
+        a = lookup_node(snap, &i, &rbinf);
+        b = lookup_node(root, &i, &rbinf);
+        if(a->n != i || (i % 2 == 0 ? b != &nil : b->n != i || b == a)) {
+            printf("Snapshot and new version disagree at %d.\n", i);
+            goto out;
+        }
+    }
+    epoch_exit(&e, slot);
+
+    // lock-free readers while the evens come and go
+    r = (reader_t){ .e = &e, .root = &root };
+    for(i=0; i<3; i++)
+        pthread_create(th+i, NULL, persist_reader, &r);
+    for(j=0; j<4; j++)
+        for(i=0; i<N; i+=2) {
+            if(j % 2 == 0)
+                epoch_publish(&root, padd_node(root, new_ent(i), &R, &c, &rbinf));
+            else
+                epoch_publish(&root, pdel_node(root, &i, &R, &c, &rbinf));
+            epoch_collect(&e);
+        }
+    __atomic_store_n(&r.stop, 1, __ATOMIC_RELEASE);
+    for(i=0; i<3; i++)
+        pthread_join(th[i], NULL);
+    if(r.err) {
+        printf("A reader saw a broken snapshot.\n");
+        goto out;
+    }
+    if(check_tree(root) < 0) goto out;
+    for(i=0; i<N; i++)
+        if((lookup_node(root, &i, &rbinf) == &nil) != (i % 2 == 0)) {
+            printf("Lost track of %d.\n", i);
+            goto out;
+        }
+    ret = 0;
+out:
+    clear_tree(&root, free_cb, NULL, &rbinf);
+    epoch_destroy(&e);
+    return ret;
+}
+
+static void moved_cb(void *from, void *to, void *ctx) {
+    struct dirent *a = from, *b = to;
+    int *count = ctx;
+
+    if(a->n != b->n) *count = -N;
+    (*count)++;
+}
+
+// Churn a tree of pooled nodes, then compact it both ways.
+static int test_pool(void) {
+    rbpool_t pl;
+    void *tree = &nil;
+    struct dirent *a;
+    int i, j, order, count, ret = 1;
+
+    pool_init(&pl, sizeof(struct dirent), 64);
+    for(j=0; j<2*N; j++) { // add each key, then replace random ones
+        i = j < N ? j*7 % N : random() % N;
+        if(j >= N) pool_free(&pl, del_node(&tree, &i, &rbinf));
+        if( (a = pool_alloc(&pl)) == NULL) goto out;
+        a->n = i;
+        a->mark = 0;
+        if(add_node(&tree, a, &rbinf) != &nil) goto out;
+    }
+    if(pl.live != N) goto out;
+    for(order = RB_BFS; order <= RB_VEB; order++) {
+        count = 0;
+        if(pool_compact(&pl, &tree, order, moved_cb, &count, &rbinf))
+            goto out;
+        if(count != N || tree != (void *)(pl.chunks+1)) {
+            printf("Compaction moved %d nodes.\n", count);
+            goto out;
+        }
+        if(check_tree(tree) < 0 || test_iter(tree)) goto out;
+    }
+    ret = 0;
+out:
+    pool_destroy(&pl);
+    return ret;
+}
+
+// Returns the black-height of a, or -1 if it is not a red/black tree
+// holding keys in (lo, hi).
+static int check_rec(struct dirent *a, int lo, int hi) {
+    struct dirent *L, *R;
+    int l, r;
+
+    if(a == &nil) return 0;
+    if(a->n < lo || a->n > hi || (!(rbinf.flags & RB_MULTI)
+                                  && (a->n == lo || a->n == hi))) {
+        printf("Node %d out of order.\n", a->n);
+        return -1;
+    }
+    if((rbinf.flags & RB_TAGGED) && (a->mark & rbinf.mask)) {
+        printf("Node %d has its color in the mark byte.\n", a->n);
+        return -1;
+    }
+    L = child_node(a, -1, &rbinf);
+    R = child_node(a, 1, &rbinf);
+    if(get_mask(a, &rbinf) && ((get_mask(L, &rbinf) && L != &nil)
+                            || (get_mask(R, &rbinf) && R != &nil))) {
+        printf("Red node %d has a red child.\n", a->n);
+        return -1;
+    }
+    if( (l = check_rec(L, lo, a->n)) < 0) return -1;
+    if( (r = check_rec(R, a->n, hi)) < 0) return -1;
+    if(l != r) {
+        printf("Node %d has unequal black-heights.\n", a->n);
+        return -1;
+    }
+    if((rbinf.flags & RB_COUNT) && a->size != 1 + (L == &nil ? 0 : L->size)
+                                             + (R == &nil ? 0 : R->size)) {
+        printf("Node %d has the wrong size.\n", a->n);
+        return -1;
+    }
+    return l + !get_mask(a, &rbinf);
+}
+
+static int check_tree(struct dirent *a) {
+    if(a != &nil && get_mask(a, &rbinf)) {
+        printf("Root is red.\n");
+        return -1;
+    }
+    return check_rec(a, -1, N);
+}
+
 static void dot_rec(FILE *f, struct dirent *a, int n) {
+    struct dirent *L, *R;
+
     fprintf(f, "  %d [", a->n);
     if(get_mask(a, &rbinf)) {
         fprintf(f, "color=\"red\" ");
@@ -121,13 +1289,13 @@ static void dot_rec(FILE *f, struct dirent *a, int n) {
     }
     fprintf(f, "rank=%d];\n", n);
 
-    if(a->L != &nil) {
-        fprintf(f, "%d -> %d;\n", a->n, a->L->n);
-        dot_rec(f, a->L, n+1);
+    if( (L = child_node(a, -1, &rbinf)) != &nil) {
+        fprintf(f, "%d -> %d;\n", a->n, L->n);
+        dot_rec(f, L, n+1);
     }
-    if(a->R != &nil) {
-        fprintf(f, "%d -> %d;\n", a->n, a->R->n);
-        dot_rec(f, a->R, n+1);
+    if( (R = child_node(a, 1, &rbinf)) != &nil) {
+        fprintf(f, "%d -> %d;\n", a->n, R->n);
+        dot_rec(f, R, n+1);
     }
 }
 
@@ -141,7 +1309,6 @@ void tree_to_dot(FILE *f, struct dirent *a) {
 
 int show_tree(char *name, struct dirent *a, int waitfor) {
     FILE *f;
-    char *buf;
     int stat;
     pid_t pid;
 
@@ -0,0 +1,145 @@
+/*    Copyright (C) David M. Rogers, 2014
+ *
+ *    David M. Rogers <predictivestatmech@gmail.com>
+ *    Nonequilibrium Stat. Mech. Research Group
+ *    Department of Chemistry
+ *    University of South Florida
+ *
+ *    This file is part of rbtree.
+ *
+ *    rbtree is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    rbtree is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with rbtree.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Checks rb::intrusive_tree, which rebalances on its own
+ * (not through rbtree.c), against a plain table of which node
+ * should hold each key, over random inserts (including
+ * replacements of equal keys) and erases.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "rbtree.hpp"
+
+struct ent {
+    int n;
+    unsigned char mark;
+    ent *L, *R;
+};
+
+struct ent_cmp {
+    int operator()(const ent &a, const ent &b) const {
+        return (a.n > b.n) - (a.n < b.n);
+    }
+    int operator()(int k, const ent &b) const {
+        return (k > b.n) - (k < b.n);
+    }
+};
+
+typedef rb::intrusive_tree<ent, &ent::L, &ent::R, &ent::mark, ent_cmp> tree_t;
+
+static ent nil = {-1, 0, NULL, NULL};
+
+static const int K = 1 << 11; // keys
+static const int OPS = 1 << 16;
+
+static ent a[K], b[K]; // two nodes per key, to test replacement
+static ent *in[K]; // the node that should hold each key, or NULL
+static int seen;
+
+// Returns the black-height of C, or -1 if it is not a red/black tree
+// holding exactly the nodes in in[] with keys in (lo, hi).
+static int check_rec(ent *C, int lo, int hi) {
+    int l, r;
+
+    if(C == &nil) return 0;
+    if(C->n <= lo || C->n >= hi) {
+        printf("Node %d out of order.\n", C->n);
+        return -1;
+    }
+    if(in[C->n] != C) {
+        printf("Node %d should not be in the tree.\n", C->n);
+        return -1;
+    }
+    if((C->mark & 1) && ((C->L->mark & 1) || (C->R->mark & 1))) {
+        printf("Red node %d has a red child.\n", C->n);
+        return -1;
+    }
+    seen++;
+    if( (l = check_rec(C->L, lo, C->n)) < 0) return -1;
+    if( (r = check_rec(C->R, C->n, hi)) < 0) return -1;
+    if(l != r) {
+        printf("Node %d has unequal black-heights.\n", C->n);
+        return -1;
+    }
+    return l + !(C->mark & 1);
+}
+
+static int check_tree(const tree_t &t) {
+    int i, n = 0;
+
+    for(i=0; i<K; i++)
+        n += in[i] != NULL;
+    if(t.root() != &nil && (t.root()->mark & 1)) {
+        printf("Root is red.\n");
+        return -1;
+    }
+    seen = 0;
+    if(check_rec(t.root(), -1, K) < 0) return -1;
+    if(seen != n) {
+        printf("Tree holds %d of %d nodes.\n", seen, n);
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    tree_t t(&nil);
+    ent *A, *want;
+    int i, k;
+
+    if(argc >= 2) srandom(atoi(argv[1]));
+    for(k=0; k<K; k++)
+        a[k].n = b[k].n = k;
+    printf("Testing %d template tree inserts and erases.\n", OPS);
+    for(i=0; i<OPS; i++) {
+        k = random() % K;
+        want = in[k] != NULL ? in[k] : &nil;
+        if(random() % 3) { // grow while testing both
+            A = random() % 2 ? a+k : b+k;
+            if(t.insert(A) != want) {
+                printf("Insert of %d returned the wrong node.\n", k);
+                return 1;
+            }
+            in[k] = A;
+        } else {
+            if(t.erase(k) != want) {
+                printf("Erase of %d returned the wrong node.\n", k);
+                return 1;
+            }
+            in[k] = NULL;
+        }
+        if(t.find(k) != (in[k] != NULL ? in[k] : &nil)) {
+            printf("Find of %d failed.\n", k);
+            return 1;
+        }
+        if(i % 97 == 0 && check_tree(t) < 0) return 1;
+    }
+    printf("Testing erase of every key.\n");
+    for(k=0; k<K; k++) {
+        want = in[k] != NULL ? in[k] : &nil;
+        if(t.erase(k) != want) return 1;
+        in[k] = NULL;
+        if(k % 64 == 0 && check_tree(t) < 0) return 1;
+    }
+    return !t.empty();
+}